@@ -1,151 +1,979 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <fcntl.h>
 #include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/wwait.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../Instrumentation/sop-instr.h"
+
 #define MAX_NUM 10
 #define MAX_TASK_COUNT 5
 #define WORKER_SLEEP_MIN 500
 #define WORKER_SLEEP_MAX 2000
-#define MAX_MSG_SIZE 128
+#define MAX_MSG_SIZE 512
+#define MAX_TASK_MSG_SIZE 8192 // Largest task message size, the default msgsize_max of the kernel
+#define MAX_MSG_COUNT 10
+#define MIN_WORKERS 2
 #define MAX_WORKERS 20
+#define MAX_THREADS 16
+#define RESULT_BATCH 5     // Results buffered per thread before one mq_send
 #define TASK_QUEUE_NAME_MAX_LEN 64
 #define RESULT_QUEUE_NAME_MAX_LEN 64
 
+#define PAYLOAD_SLOTS 64      // Number of payload slots in the shared arena
+#define PAYLOAD_DOUBLES 4096  // Capacity of one payload slot (32 KB)
+#define TILE 32               // Matrix tile edge for TASK_MATMUL
+#define TASK_STOP (-1)        // Task type telling a worker thread to exit in benchmark mode
+#define BENCH_DEFAULT_COUNT 10000
+
+#define JOURNAL_MAGIC 0x4a535744u        // "DWSJ", marks a valid journal header
+#define JOURNAL_RECORD_MAGIC 0x43455244u // "DREC", written last so torn records are skipped
+#define JOURNAL_DEFAULT_GROUP 64         // Records per group commit
+#define JOURNAL_COMMIT_INTERVAL_MS 10    // Longest time a server record waits for its commit
+#define JOURNAL_SLACK 1024               // Spare records on top of the expected task count
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
+// Per-task output is silenced in benchmark mode so it does not dominate the measurement
+#define LOG(...)                     \
+    do {                             \
+        if (!bench_mode)             \
+            printf(__VA_ARGS__);     \
+    } while (0)
+
 volatile sig_atomic_t children_left = 0;
+int bench_mode = 0;                  // Set by -B; workers run until TASK_STOP and skip simulated sleeps
+
+// Task types understood by the workers, used as an index into task_registry
+typedef enum {
+    TASK_ADD,
+    TASK_VSUM,
+    TASK_DOT,
+    TASK_MATMUL,
+    TASK_HASH,
+    TASK_TYPE_COUNT
+} task_type_t;
+
+// Priority classes, used directly as the mqueue message priority (higher is delivered first)
+typedef enum {
+    PRIORITY_BULK,
+    PRIORITY_NORMAL,
+    PRIORITY_URGENT,
+    PRIORITY_COUNT
+} priority_class_t;
+
+const char *priority_names[PRIORITY_COUNT] = {"bulk", "normal", "urgent"};
+
+// Task message sent through the task queue; bulk data stays in the shared arena
+typedef struct {
+    long id;      // Task id, unique across restarts when the journal is enabled
+    int type;     // task_type_t
+    int handle;   // Payload slot index, -1 for tasks without payload
+    int length;   // Number of payload elements used by the task
+    int priority; // priority_class_t
+    long sent_ns;     // CLOCK_MONOTONIC time the server queued the task
+    long deadline_ns; // CLOCK_MONOTONIC deadline, 0 when the task has none
+    double v1;    // Inline operands for TASK_ADD
+    double v2;
+} task_msg_t;
+
+// Result message sent back through the worker's result queue
+typedef struct {
+    long id;
+    int type;
+    int handle;
+    int thread;      // Worker thread that computed the result
+    int priority;
+    int expired;     // Deadline passed before a worker picked the task up, kernel was not run
+    double result;
+    long compute_ns; // Time spent inside the kernel
+    long sent_ns;    // Copied from the task to measure end-to-end latency
+} result_msg_t;
+
+// Batch of results flushed by one worker thread in a single message
+typedef struct {
+    int count;
+    result_msg_t results[RESULT_BATCH];
+} result_batch_t;
+
+_Static_assert(sizeof(result_batch_t) <= MAX_MSG_SIZE, "result batch does not fit in a message");
+
+// One slot of the shared payload arena, owned by the server while free and by a worker while busy
+typedef struct {
+    int busy;
+    union {
+        double d[PAYLOAD_DOUBLES];
+        unsigned char b[PAYLOAD_DOUBLES * sizeof(double)];
+    } data;
+} payload_slot_t;
+
+// Kernel computing a task result and generator filling a task (and its payload) on the server side
+typedef double (*task_kernel_t)(const task_msg_t *task, payload_slot_t *slot);
+typedef void (*task_fill_t)(task_msg_t *task, payload_slot_t *slot);
+
+typedef struct {
+    const char *name;
+    int needs_payload;
+    task_fill_t fill;
+    task_kernel_t run;
+} task_kind_t;
+
+// Journal record kinds
+typedef enum {
+    JOURNAL_DISPATCH, // Task queued by the server, carries the task description
+    JOURNAL_ACK,      // Task taken from the queue by a worker thread
+    JOURNAL_DONE      // Result (or expiry) received by the server
+} journal_kind_t;
+
+// Header of the journal file, shared by the server and all workers through the mapping
+typedef struct {
+    uint32_t magic;
+    int32_t server_pid; // Owner of the queues named in this journal
+    uint64_t next_id;   // Next task id
+    uint64_t tail;      // Number of reserved records, advanced atomically by every appender
+    uint64_t capacity;  // Number of records that fit in the file
+} journal_header_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t kind;      // journal_kind_t
+    int32_t pid;        // Process that appended the record
+    int32_t reserved;
+    task_msg_t task;    // Full description for JOURNAL_DISPATCH, only the id otherwise
+} journal_record_t;
+
+// Append-only journal mapped MAP_SHARED before fork
+typedef struct {
+    char path[256];
+    int fd;
+    size_t size;
+    journal_header_t *header;
+    journal_record_t *records;
+    long group;          // Group commit size
+    long uncommitted;    // Server records appended since the last commit
+    uint64_t synced;     // Records below this index are already on disk
+    long commits;
+    pthread_t committer; // Server thread doing the msync off the hot path
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    int stop;
+} journal_t;
+
+// Per-thread state of a worker process
+typedef struct {
+    int id;
+    pthread_t tid;
+    mqd_t task_queue;
+    mqd_t result_queue;
+    unsigned int seed;
+    int tasks_done;
+    long busy_ns;
+    long wall_ns;
+    result_batch_t batch; // Results not yet sent to the server
+} worker_thread_t;
+
+// Load generator settings of benchmark mode
+typedef struct {
+    long rate;     // Tasks per second, 0 for closed-loop maximum throughput
+    long count;    // Tasks per run
+    int msg_size;  // Task message size, 0 for the natural size
+    int sweep;     // Sweep worker counts and message sizes
+} bench_config_t;
+
+// Per-class latency statistics collected by the server
+typedef struct {
+    long count;
+    long expired;
+    long total_ns;
+    long min_ns;
+    long max_ns;
+} class_stats_t;
+
+// Task generation settings chosen on the command line
+typedef struct {
+    int task_type;   // task_type_t, -1 for a random mix
+    int priority;    // priority_class_t, -1 for a random mix
+    long deadline_ms; // Relative deadline, 0 for none
+} task_config_t;
 
 typedef struct {
     mqd_t mq;
+    int worker_id;
     char queue_name[RESULT_QUEUE_NAME_MAX_LEN];
 } WorkerQueue;
 
+payload_slot_t *payload_arena = NULL; // Shared between the server and all workers
+
+pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER; // Result notifications run on several threads
+class_stats_t class_stats[PRIORITY_COUNT];
+long results_received = 0;
+long *latencies = NULL; // End-to-end latencies of the current benchmark run
+long latency_count = 0;
+long latency_capacity = 0;
+int task_msg_size = sizeof(task_msg_t); // Size of every message on the task queue
+long next_task_id = 1;  // Used when running without a journal
+
+journal_t *journal = NULL;   // NULL unless -j was given
+long total_journal_commits = 0;
+task_msg_t *recovered_tasks = NULL; // Dispatched but never completed in a previous run
+long recovered_count = 0;
+long recovered_next = 0;
+
+// Function to get a random double in the range [0.0, 100.99]
+double random_value(void) { return (rand() % 101) + (rand() % 100) / 100.0; }
+
+// Function to fill a block of doubles with random values
+void fill_random(double *data, int count) {
+    for (int i = 0; i < count; i++)
+        data[i] = random_value();
+}
+
+void fill_add(task_msg_t *task, payload_slot_t *slot) {
+    (void)slot;
+    task->v1 = random_value();
+    task->v2 = random_value();
+}
+
+double run_add(const task_msg_t *task, payload_slot_t *slot) {
+    (void)slot;
+    return task->v1 + task->v2;
+}
+
+void fill_vsum(task_msg_t *task, payload_slot_t *slot) {
+    task->length = PAYLOAD_DOUBLES;
+    fill_random(slot->data.d, task->length);
+}
+
+double run_vsum(const task_msg_t *task, payload_slot_t *slot) {
+    const double *v = slot->data.d;
+    double sum = 0.0;
+    for (int i = 0; i < task->length; i++)
+        sum += v[i];
+    return sum;
+}
+
+// The two vectors are stored back to back in the slot
+void fill_dot(task_msg_t *task, payload_slot_t *slot) {
+    task->length = PAYLOAD_DOUBLES / 2;
+    fill_random(slot->data.d, 2 * task->length);
+}
+
+double run_dot(const task_msg_t *task, payload_slot_t *slot) {
+    const double *a = slot->data.d;
+    const double *b = slot->data.d + task->length;
+    double sum = 0.0;
+    for (int i = 0; i < task->length; i++)
+        sum += a[i] * b[i];
+    return sum;
+}
+
+// Slot layout: A, B and the output tile C, each TILE x TILE in row-major order
+void fill_matmul(task_msg_t *task, payload_slot_t *slot) {
+    task->length = TILE;
+    fill_random(slot->data.d, 2 * TILE * TILE);
+}
+
+double run_matmul(const task_msg_t *task, payload_slot_t *slot) {
+    int n = task->length;
+    const double *a = slot->data.d;
+    const double *b = a + n * n;
+    double *c = slot->data.d + 2 * n * n;
+    double trace = 0.0;
+
+    memset(c, 0, sizeof(double) * n * n);
+    for (int i = 0; i < n; i++)
+        for (int k = 0; k < n; k++) {
+            double aik = a[i * n + k];
+            for (int j = 0; j < n; j++)
+                c[i * n + j] += aik * b[k * n + j];
+        }
+    for (int i = 0; i < n; i++)
+        trace += c[i * n + i];
+    return trace;
+}
+
+void fill_hash(task_msg_t *task, payload_slot_t *slot) {
+    task->length = sizeof(slot->data.b);
+    for (int i = 0; i < task->length; i++)
+        slot->data.b[i] = rand() & 0xff;
+}
+
+// 64-bit FNV-1a, folded to 53 bits so it is exact when carried as a double
+double run_hash(const task_msg_t *task, payload_slot_t *slot) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (int i = 0; i < task->length; i++) {
+        h ^= slot->data.b[i];
+        h *= 0x100000001b3ULL;
+    }
+    return (double)(h >> 11);
+}
+
+const task_kind_t task_registry[TASK_TYPE_COUNT] = {
+    [TASK_ADD] = {"add", 0, fill_add, run_add},
+    [TASK_VSUM] = {"vsum", 1, fill_vsum, run_vsum},
+    [TASK_DOT] = {"dot", 1, fill_dot, run_dot},
+    [TASK_MATMUL] = {"matmul", 1, fill_matmul, run_matmul},
+    [TASK_HASH] = {"hash", 1, fill_hash, run_hash},
+};
+
+// Function to look up a task type by name, -1 means a random mix of all types
+int find_task_type(const char *name) {
+    if (strcmp(name, "mixed") == 0)
+        return -1;
+    for (int i = 0; i < TASK_TYPE_COUNT; i++)
+        if (strcmp(name, task_registry[i].name) == 0)
+            return i;
+    return -2;
+}
+
+// Function to claim a free payload slot, returns -1 when the arena is full
+int acquire_slot(void) {
+    for (int i = 0; i < PAYLOAD_SLOTS; i++) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&payload_arena[i].busy, &expected, 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return i;
+    }
+    return -1;
+}
+
+void release_slot(int handle) {
+    if (handle >= 0)
+        __atomic_store_n(&payload_arena[handle].busy, 0, __ATOMIC_RELEASE);
+}
+
+long elapsed_ns(struct timespec start, struct timespec end) {
+    return (end.tv_sec - start.tv_sec) * 1000000000L + (end.tv_nsec - start.tv_nsec);
+}
+
+// Function to read CLOCK_MONOTONIC in nanoseconds, comparable between the server and workers
+long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+// Function to look up a priority class by name, -1 means a random mix of classes
+int find_priority(const char *name) {
+    if (strcmp(name, "mixed") == 0)
+        return -1;
+    for (int i = 0; i < PRIORITY_COUNT; i++)
+        if (strcmp(name, priority_names[i]) == 0)
+            return i;
+    return -2;
+}
+
+// Mixed load: 60% bulk, 30% normal, 10% urgent
+int random_priority(void) {
+    int r = rand() % 10;
+    return r < 6 ? PRIORITY_BULK : r < 9 ? PRIORITY_NORMAL : PRIORITY_URGENT;
+}
+
+// Function to map a journal file of the given size
+void journal_map(journal_t *j, int fd, size_t size) {
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        ERR("mmap (journal)");
+    j->fd = fd;
+    j->size = size;
+    j->header = (journal_header_t *)map;
+    j->records = (journal_record_t *)(j->header + 1);
+}
+
+// Function to flush the journal to disk
+void journal_commit(void) {
+    if (journal == NULL)
+        return;
+    // Only the pages written since the last commit are synced, plus the page holding the header
+    long page = sysconf(_SC_PAGESIZE);
+    uint64_t tail = __atomic_load_n(&journal->header->tail, __ATOMIC_ACQUIRE);
+    uint64_t synced = __atomic_exchange_n(&journal->synced, tail, __ATOMIC_ACQ_REL);
+    char *base = (char *)journal->header;
+    size_t from = (sizeof(journal_header_t) + sizeof(journal_record_t) * synced) / page * page;
+    size_t to = sizeof(journal_header_t) + sizeof(journal_record_t) * tail;
+    if (to > journal->size)
+        to = journal->size;
+    if (msync(base, page, MS_SYNC) < 0 || (to > from && msync(base + from, to - from, MS_SYNC) < 0))
+        ERR("msync (journal)");
+    __atomic_store_n(&journal->uncommitted, 0, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&journal->commits, 1, __ATOMIC_RELAXED);
+}
+
+// Function to append a record; records of the server are made durable in groups of journal->group
+void journal_append(journal_kind_t kind, const task_msg_t *task, int server) {
+    if (journal == NULL)
+        return;
+    uint64_t idx = __atomic_fetch_add(&journal->header->tail, 1, __ATOMIC_RELAXED);
+    if (idx >= journal->header->capacity) {
+        fprintf(stderr, "[%d] Journal is full, task %ld is not recorded\n", getpid(), task->id);
+        return;
+    }
+    journal_record_t *record = &journal->records[idx];
+    record->kind = kind;
+    record->pid = getpid();
+    if (kind == JOURNAL_DISPATCH)
+        record->task = *task;
+    else
+        record->task.id = task->id;
+    __atomic_store_n(&record->magic, JOURNAL_RECORD_MAGIC, __ATOMIC_RELEASE);
+
+    // Appenders never wait for the disk, they only wake the committer once a group is complete
+    if (server && __atomic_add_fetch(&journal->uncommitted, 1, __ATOMIC_RELAXED) == journal->group) {
+        pthread_mutex_lock(&journal->lock);
+        pthread_cond_signal(&journal->wakeup);
+        pthread_mutex_unlock(&journal->lock);
+    }
+}
+
+// Committer thread: syncs a group when it is complete or when the commit interval elapses
+void *journal_committer(void *arg) {
+    journal_t *j = (journal_t *)arg;
+    pthread_mutex_lock(&j->lock);
+    while (!j->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += JOURNAL_COMMIT_INTERVAL_MS * 1000000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+        while (!j->stop && __atomic_load_n(&j->uncommitted, __ATOMIC_RELAXED) < j->group)
+            if (pthread_cond_timedwait(&j->wakeup, &j->lock, &deadline) == ETIMEDOUT)
+                break;
+        if (__atomic_load_n(&j->uncommitted, __ATOMIC_RELAXED) == 0)
+            continue;
+        pthread_mutex_unlock(&j->lock);
+        journal_commit();
+        pthread_mutex_lock(&j->lock);
+    }
+    pthread_mutex_unlock(&j->lock);
+    return NULL;
+}
+
+// Function to collect tasks that were dispatched but never completed, returns their number
+long journal_pending(const journal_header_t *header, const journal_record_t *records, task_msg_t **pending) {
+    uint64_t count = header->tail < header->capacity ? header->tail : header->capacity;
+    long min_id = 0, max_id = -1;
+    for (uint64_t i = 0; i < count; i++) {
+        if (records[i].magic != JOURNAL_RECORD_MAGIC)
+            continue;
+        long id = records[i].task.id;
+        if (max_id < min_id || id < min_id)
+            min_id = id;
+        if (id > max_id)
+            max_id = id;
+    }
+    *pending = NULL;
+    if (max_id < min_id)
+        return 0;
+
+    // One state byte per id: 1 dispatched, 2 done
+    char *state = calloc(max_id - min_id + 1, 1);
+    if (state == NULL)
+        ERR("calloc");
+    long dispatched = 0;
+    for (uint64_t i = 0; i < count; i++) {
+        if (records[i].magic != JOURNAL_RECORD_MAGIC)
+            continue;
+        long slot = records[i].task.id - min_id;
+        if (records[i].kind == JOURNAL_DONE)
+            state[slot] = 2;
+        else if (records[i].kind == JOURNAL_DISPATCH && state[slot] == 0) {
+            state[slot] = 1;
+            dispatched++;
+        }
+    }
+
+    long n = 0;
+    if (dispatched > 0 && (*pending = malloc(sizeof(task_msg_t) * dispatched)) == NULL)
+        ERR("malloc");
+    for (uint64_t i = 0; i < count; i++) {
+        if (records[i].magic == JOURNAL_RECORD_MAGIC && records[i].kind == JOURNAL_DISPATCH &&
+            state[records[i].task.id - min_id] == 1) {
+            (*pending)[n++] = records[i].task;
+            state[records[i].task.id - min_id] = 3;
+        }
+    }
+    free(state);
+    return n;
+}
+
+// Function to remove the queues of a server that died without cleaning up
+void unlink_stale_queues(pid_t server_pid) {
+    if (server_pid <= 0 || server_pid == getpid() || kill(server_pid, 0) == 0 || errno != ESRCH)
+        return;
+    char name[RESULT_QUEUE_NAME_MAX_LEN];
+    int removed = 0;
+    snprintf(name, sizeof(name), "/task_queue_%d", server_pid);
+    removed += mq_unlink(name) == 0;
+    for (int i = 1; i <= MAX_WORKERS; i++) {
+        snprintf(name, sizeof(name), "/result_queue_%d_%d", server_pid, i);
+        removed += mq_unlink(name) == 0;
+    }
+    if (removed)
+        printf("Removed %d stale queues of server %d\n", removed, server_pid);
+}
+
+// Function to write a fresh journal holding only the pending tasks and swap it in with rename
+void journal_rewrite(const char *path, const task_msg_t *pending, long pending_count, uint64_t next_id,
+                     long capacity, long group) {
+    char tmp_path[sizeof(journal->path) + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        ERR("open (journal)");
+    size_t size = sizeof(journal_header_t) + sizeof(journal_record_t) * (capacity + pending_count);
+    // Blocks are allocated up front so appends through the mapping never allocate on a page fault
+    if ((errno = posix_fallocate(fd, 0, size)) != 0)
+        ERR("posix_fallocate (journal)");
+
+    journal_t *j = calloc(1, sizeof(journal_t));
+    if (j == NULL)
+        ERR("calloc");
+    snprintf(j->path, sizeof(j->path), "%s", path);
+    j->group = group;
+    journal_map(j, fd, size);
+    j->header->server_pid = getpid();
+    j->header->next_id = next_id;
+    j->header->capacity = capacity + pending_count;
+    j->header->magic = JOURNAL_MAGIC;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->wakeup, NULL);
+
+    // Pending tasks keep their ids and are journaled again before they are re-queued
+    journal = j;
+    for (long i = 0; i < pending_count; i++)
+        journal_append(JOURNAL_DISPATCH, &pending[i], 0);
+    journal_commit();
+    if (rename(tmp_path, path) < 0)
+        ERR("rename (journal)");
+    if ((errno = pthread_create(&j->committer, NULL, journal_committer, j)) != 0)
+        ERR("pthread_create (journal)");
+}
+
+// Function to unmap and close the current journal
+void journal_close(void) {
+    if (journal == NULL)
+        return;
+    pthread_mutex_lock(&journal->lock);
+    journal->stop = 1;
+    pthread_cond_signal(&journal->wakeup);
+    pthread_mutex_unlock(&journal->lock);
+    pthread_join(journal->committer, NULL);
+    journal_commit();
+    total_journal_commits += journal->commits;
+    pthread_mutex_destroy(&journal->lock);
+    pthread_cond_destroy(&journal->wakeup);
+    munmap(journal->header, journal->size);
+    close(journal->fd);
+    free(journal);
+    journal = NULL;
+}
+
+// Function to open the journal, recover the tasks of a previous run and compact it
+void journal_open(const char *path, long capacity, long group) {
+    uint64_t next_id = 1;
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0) {
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+            ERR("fstat (journal)");
+        if ((size_t)st.st_size >= sizeof(journal_header_t)) {
+            journal_header_t *header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (header == MAP_FAILED)
+                ERR("mmap (journal)");
+            uint64_t fits = (st.st_size - sizeof(journal_header_t)) / sizeof(journal_record_t);
+            if (header->magic == JOURNAL_MAGIC && header->capacity <= fits) {
+                unlink_stale_queues(header->server_pid);
+                next_id = header->next_id;
+                recovered_count = journal_pending(header, (journal_record_t *)(header + 1), &recovered_tasks);
+                if (recovered_count > 0)
+                    printf("Recovered %ld unfinished tasks from %s\n", recovered_count, path);
+            } else {
+                fprintf(stderr, "Ignoring invalid journal %s\n", path);
+            }
+            munmap(header, st.st_size);
+        }
+        close(fd);
+    } else if (errno != ENOENT) {
+        ERR("open (journal)");
+    }
+    journal_rewrite(path, recovered_tasks, recovered_count, next_id, capacity, group);
+}
+
+// Function to compact the journal between runs, when no worker holds the mapping
+void journal_checkpoint(long capacity) {
+    if (journal == NULL)
+        return;
+    char path[sizeof(journal->path)];
+    long group = journal->group;
+    task_msg_t *pending;
+    snprintf(path, sizeof(path), "%s", journal->path);
+    long count = journal_pending(journal->header, journal->records, &pending);
+    uint64_t next_id = journal->header->next_id;
+    journal_close();
+    journal_rewrite(path, pending, count, next_id, capacity, group);
+    free(pending);
+}
+
+// Function to assign the next task id
+long new_task_id(void) {
+    if (journal != NULL)
+        return __atomic_fetch_add(&journal->header->next_id, 1, __ATOMIC_RELAXED);
+    return next_task_id++;
+}
+
+// Function to account a received result in the latency statistics of its class
+void record_result(const result_msg_t *result) {
+    long latency = now_ns() - result->sent_ns;
+    task_msg_t done = {.id = result->id};
+    journal_append(JOURNAL_DONE, &done, 1);
+    pthread_mutex_lock(&stats_mutex);
+    class_stats_t *stats = &class_stats[result->priority];
+    if (result->expired) {
+        stats->expired++;
+        INSTR_COUNT("dws_tasks_expired", 1);
+    } else {
+        INSTR_VALUE("dws_task_latency_ns", latency);
+        if (stats->count == 0 || latency < stats->min_ns)
+            stats->min_ns = latency;
+        if (latency > stats->max_ns)
+            stats->max_ns = latency;
+        stats->total_ns += latency;
+        stats->count++;
+        if (latency_count < latency_capacity)
+            latencies[latency_count++] = latency;
+    }
+    results_received++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+// Function to print the per-class latency statistics
+void print_class_stats(void) {
+    printf("Class     done  expired   min ms   avg ms   max ms\n");
+    for (int i = PRIORITY_COUNT - 1; i >= 0; i--) {
+        class_stats_t *stats = &class_stats[i];
+        double avg = stats->count ? (double)stats->total_ns / stats->count : 0.0;
+        printf("%-7s %6ld %8ld %8.2f %8.2f %8.2f\n", priority_names[i], stats->count, stats->expired,
+               stats->min_ns / 1e6, avg / 1e6, stats->max_ns / 1e6);
+    }
+}
+
+// Function to print all results waiting in a worker's result queue
+void drain_results(WorkerQueue *worker_queue) {
+    char msg[MAX_MSG_SIZE];
+    result_batch_t batch;
+    while (mq_receive(worker_queue->mq, msg, MAX_MSG_SIZE, NULL) >= 0) {
+        memcpy(&batch, msg, sizeof(batch));
+        for (int i = 0; i < batch.count; i++) {
+            result_msg_t *result = &batch.results[i];
+            record_result(result);
+            if (result->expired) {
+                LOG("Expired on worker %d/%d [%s, %s]\n", worker_queue->worker_id, result->thread,
+                       task_registry[result->type].name, priority_names[result->priority]);
+                continue;
+            }
+            LOG("Result from worker %d/%d [%s, %s]: %.2f (%ld us)\n", worker_queue->worker_id, result->thread,
+                   task_registry[result->type].name, priority_names[result->priority], result->result,
+                   result->compute_ns / 1000);
+        }
+    }
+    if (errno != EAGAIN)
+        perror("mq_receive");
+}
+
 // Function to handle message notification in the queue
 void message_handler(union sigval sv) {
     WorkerQueue *worker_queue = (WorkerQueue *)sv.sival_ptr;
-    char result[MAX_MSG_SIZE];
-    
-    // Receive result message from the worker's queue
-    if (mq_receive(worker_queue->mq, result, MAX_MSG_SIZE, NULL) < 0) {
-        perror("mq_receive");
-        return;
-    }
 
-    // Extract the worker's PID from the queue name
-    int worker_pid = atoi(worker_queue->queue_name + strlen("/result_queue_"));
-    printf("Result from worker %d: %s\n", worker_pid, result);
+    // Notification is one-shot, re-arm it before draining so no message is missed
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = message_handler;
+    sev.sigev_value.sival_ptr = worker_queue;
+    if (mq_notify(worker_queue->mq, &sev) == -1)
+        perror("mq_notify");
+
+    drain_results(worker_queue);
 }
 
-// Function to add a task to the task queue
-void add_task_to_queue(mqd_t task_queue) {
-    double v1 = (rand() % 101) + (rand() % 100) / 100.0;
-    double v2 = (rand() % 101) + (rand() % 100) / 100.0;
+// Function to add a task to the task queue, returns 0 on success, -1 when the queue and -2 when the arena is full
+int add_task_to_queue(mqd_t task_queue, const task_config_t *config) {
+    INSTR_SCOPE("dws_enqueue");
+    task_msg_t task = {.handle = -1};
+    int recovered = recovered_next < recovered_count;
+    if (recovered) {
+        // Tasks recovered from the journal go first; they keep their id, type, class and inline operands
+        task = recovered_tasks[recovered_next];
+        task.handle = -1;
+        task.deadline_ns = 0;
+    } else {
+        task.type = config->task_type < 0 ? rand() % TASK_TYPE_COUNT : config->task_type;
+        task.priority = config->priority < 0 ? random_priority() : config->priority;
+    }
+    int type = task.type;
+    const task_kind_t *kind = &task_registry[type];
+
+    if (kind->needs_payload) {
+        if ((task.handle = acquire_slot()) < 0) {
+            LOG("Payload arena is full!\n");
+            INSTR_COUNT("dws_arena_full", 1);
+            return -2;
+        }
+    }
+    // Payloads live in the anonymous arena and are not journaled, so recovered tasks get a new one
+    if (!recovered || kind->needs_payload)
+        kind->fill(&task, task.handle < 0 ? NULL : &payload_arena[task.handle]);
+    if (!recovered)
+        task.id = new_task_id();
+
+    task.sent_ns = now_ns();
+    if (config->deadline_ms > 0)
+        task.deadline_ns = task.sent_ns + config->deadline_ms * 1000000L;
 
-    char task[MAX_MSG_SIZE];
-    snprintf(task, MAX_MSG_SIZE, "%.2f %.2f", v1, v2);
+    // Messages are padded up to task_msg_size
+    char msg[MAX_TASK_MSG_SIZE];
+    memcpy(msg, &task, sizeof(task));
 
     // Try to add the task to the queue, handle full queue situation
-    if (mq_send(task_queue, task, MAX_MSG_SIZE, 0) == -1) {
-        perror("mq_send (server)");
-        printf("Queue is full!\n");
+    if (mq_send(task_queue, msg, task_msg_size, task.priority) == -1) {
+        if (errno != EAGAIN)
+            perror("mq_send (server)");
+        LOG("Queue is full!\n");
+        INSTR_COUNT("dws_queue_full", 1);
+        release_slot(task.handle);
+        return -1;
+    }
+    INSTR_COUNT("dws_tasks_sent", 1);
+    if (recovered)
+        recovered_next++;
+    else
+        journal_append(JOURNAL_DISPATCH, &task, 1);
+    if (type == TASK_ADD) {
+        LOG("New %s task queued: [%.2f, %.2f]\n", priority_names[task.priority], task.v1, task.v2);
     } else {
-        printf("New task queued: [%.2f, %.2f]\n", v1, v2);
+        LOG("New %s task queued: %s, slot %d, %d elements\n", priority_names[task.priority], kind->name,
+            task.handle, task.length);
+    }
+    return 0;
+}
+
+// Function to wait until every worker process has exited
+void wait_children(void) {
+    while (children_left > 0) {
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("wait");
+        }
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+            fprintf(stderr, "Worker %d died, its unfinished tasks stay in the journal\n", pid);
+        children_left--;
     }
 }
 
 // Parent process function that manages the tasks and workers
-void parent_work(int n, mqd_t task_queue) {
-    for (int i = 0; i < n * 5; ++i) {
+void parent_work(int n, int threads, mqd_t task_queue, const task_config_t *config) {
+    for (int i = 0; i < n * threads * MAX_TASK_COUNT; ++i) {
         int wait_time = (rand() % 4001) + 1000; // Random wait between 1000 ms and 5000 ms
         usleep(wait_time * 1000);
-        add_task_to_queue(task_queue); // Add new task to the queue
+        add_task_to_queue(task_queue, config); // Add new task to the queue
+        INSTR_TICK();
     }
 
     // Wait for child processes to finish
-    srand(getpid());
-    while (children_left)
-        ;
-
+    wait_children();
     printf("All child processes have finished.\n");
 }
 
-// Worker function to process tasks from the task queue and send results
-void child_work(mqd_t task_queue, mqd_t result_queue) {
-    printf("[%d] Worker ready!\n", getpid());
-    srand(getpid());
-    
-    for (int life = MAX_TASK_COUNT; life > 0; life--) {
-        char task[MAX_MSG_SIZE];
-        if (mq_receive(task_queue, task, MAX_MSG_SIZE, NULL) < 0) {
-            ERR("mq_receive");
+// Function to send the buffered results of a worker thread as one message
+void flush_results(worker_thread_t *worker) {
+    if (worker->batch.count == 0)
+        return;
+    if (mq_send(worker->result_queue, (const char *)&worker->batch, sizeof(worker->batch), 0) < 0) {
+        perror("mq_send (worker)");
+    }
+    worker->batch.count = 0;
+}
+
+// Function to take the next task, sending any buffered results before the thread would block
+void receive_task(worker_thread_t *worker, char *msg) {
+    // An absolute deadline in the past turns the first attempt into a non-blocking poll
+    struct timespec expired = {0, 0};
+    if (mq_timedreceive(worker->task_queue, msg, MAX_TASK_MSG_SIZE, NULL, &expired) >= 0)
+        return;
+    if (errno != ETIMEDOUT && errno != EAGAIN)
+        ERR("mq_timedreceive");
+    flush_results(worker);
+    if (mq_receive(worker->task_queue, msg, MAX_TASK_MSG_SIZE, NULL) < 0) {
+        ERR("mq_receive");
+    }
+}
+
+// Worker thread function to process tasks from the shared task queue
+void *worker_thread(void *arg) {
+    worker_thread_t *worker = (worker_thread_t *)arg;
+    struct timespec thread_start, thread_end;
+    clock_gettime(CLOCK_MONOTONIC, &thread_start);
+
+    // Outside benchmark mode every thread has a fixed life of MAX_TASK_COUNT tasks
+    while (bench_mode || worker->tasks_done < MAX_TASK_COUNT) {
+        char msg[MAX_TASK_MSG_SIZE];
+        task_msg_t task;
+        receive_task(worker, msg);
+        memcpy(&task, msg, sizeof(task));
+        if (task.type == TASK_STOP)
+            break;
+        INSTR_TICK();
+        journal_append(JOURNAL_ACK, &task, 0);
+        worker->tasks_done++;
+        if (task.type < 0 || task.type >= TASK_TYPE_COUNT || task.priority < 0 || task.priority >= PRIORITY_COUNT) {
+            fprintf(stderr, "[%d/%d] Unknown task type %d\n", getpid(), worker->id, task.type);
+            release_slot(task.handle);
+            continue;
         }
 
-        double v1, v2;
-        sscanf(task, "%lf %lf", &v1, &v2);
-        printf("[%d] Received task [%.2f, %.2f]\n", getpid(), v1, v2);
+        const task_kind_t *kind = &task_registry[task.type];
+        result_msg_t *result = &worker->batch.results[worker->batch.count++];
+        memset(result, 0, sizeof(result_msg_t));
+        result->id = task.id;
+        result->type = task.type;
+        result->handle = task.handle;
+        result->thread = worker->id;
+        result->priority = task.priority;
+        result->sent_ns = task.sent_ns;
 
-        // Simulate work - random sleep time
-        int sleep_time = (rand() % (WORKER_SLEEP_MAX - WORKER_SLEEP_MIN + 1)) + WORKER_SLEEP_MIN;
-        usleep(sleep_time * 1000);
+        // A task past its deadline is reported back as expired instead of being executed late
+        if (task.deadline_ns && now_ns() > task.deadline_ns) {
+            LOG("[%d/%d] Task %s expired\n", getpid(), worker->id, kind->name);
+            result->expired = 1;
+            release_slot(task.handle);
+            if (worker->batch.count == RESULT_BATCH)
+                flush_results(worker);
+            continue;
+        }
+        LOG("[%d/%d] Received %s task %s\n", getpid(), worker->id, priority_names[task.priority], kind->name);
 
-        double result = v1 + v2;
-        printf("[%d] Result [%.2f]\n", getpid(), result);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        result->result = kind->run(&task, task.handle < 0 ? NULL : &payload_arena[task.handle]);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        result->compute_ns = elapsed_ns(start, end);
+        worker->busy_ns += result->compute_ns;
+        INSTR_VALUE("dws_task_compute_ns", result->compute_ns);
+        release_slot(task.handle);
 
-        // Send the result to the result queue
-        char result_msg[MAX_MSG_SIZE];
-        snprintf(result_msg, MAX_MSG_SIZE, "%.2f", result);
-        if (mq_send(result_queue, result_msg, MAX_MSG_SIZE, 0) < 0) {
-            perror("mq_send (worker)");
+        // Simulate work for the payload-less demo task - random sleep time
+        if (task.type == TASK_ADD && !bench_mode) {
+            int sleep_time = (rand_r(&worker->seed) % (WORKER_SLEEP_MAX - WORKER_SLEEP_MIN + 1)) + WORKER_SLEEP_MIN;
+            usleep(sleep_time * 1000);
         }
+        LOG("[%d/%d] Result [%.2f]\n", getpid(), worker->id, result->result);
+
+        // Results are buffered and sent once the batch is full or the thread is about to wait for work
+        if (worker->batch.count == RESULT_BATCH)
+            flush_results(worker);
     }
+    flush_results(worker);
 
-    printf("[%d] Exits!\n", getpid());
+    clock_gettime(CLOCK_MONOTONIC, &thread_end);
+    worker->wall_ns = elapsed_ns(thread_start, thread_end);
+    return NULL;
+}
+
+// Function to compute a rate in tasks per second
+double tasks_per_sec(int tasks, long ns) { return ns > 0 ? tasks * 1e9 / ns : 0.0; }
+
+// Worker process function running a pool of threads over the shared task queue
+void child_work(mqd_t task_queue, mqd_t result_queue, int threads) {
+    LOG("[%d] Worker ready with %d threads!\n", getpid(), threads);
+    worker_thread_t workers[MAX_THREADS];
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // mq descriptors are thread-safe, so all threads share the process' task and result queues
+    for (int i = 0; i < threads; i++) {
+        memset(&workers[i], 0, sizeof(worker_thread_t));
+        workers[i].id = i + 1;
+        workers[i].task_queue = task_queue;
+        workers[i].result_queue = result_queue;
+        workers[i].seed = getpid() ^ (i << 16);
+        if ((errno = pthread_create(&workers[i].tid, NULL, worker_thread, &workers[i])) != 0)
+            ERR("pthread_create");
+    }
+
+    int tasks = 0;
+    long busy_ns = 0;
+    for (int i = 0; i < threads; i++) {
+        if ((errno = pthread_join(workers[i].tid, NULL)) != 0)
+            ERR("pthread_join");
+        tasks += workers[i].tasks_done;
+        busy_ns += workers[i].busy_ns;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    for (int i = 0; i < threads; i++) {
+        LOG("[%d/%d] %d tasks, %.2f tasks/s, %ld us in kernels\n", getpid(), workers[i].id,
+            workers[i].tasks_done, tasks_per_sec(workers[i].tasks_done, workers[i].wall_ns),
+            workers[i].busy_ns / 1000);
+    }
+    LOG("[%d] Exits! %d tasks, %.2f tasks/s, %ld us in kernels\n", getpid(), tasks,
+        tasks_per_sec(tasks, elapsed_ns(start, end)), busy_ns / 1000);
 }
 
 // Function to create worker processes
-void create_children(int n, mqd_t task_queue, WorkerQueue *worker_queues) {
+void create_children(int n, int threads, mqd_t task_queue, WorkerQueue *worker_queues) {
+    struct mq_attr attr = {.mq_maxmsg = MAX_MSG_COUNT, .mq_msgsize = MAX_MSG_SIZE};
+
     while (n > 0) {
+        // The result queue is created before fork so the worker never races the server
+        WorkerQueue *worker_queue = &worker_queues[n - 1];
+        worker_queue->worker_id = n;
+        snprintf(worker_queue->queue_name, RESULT_QUEUE_NAME_MAX_LEN, "/result_queue_%d_%d", getpid(), n);
+        worker_queue->mq = mq_open(worker_queue->queue_name, O_RDONLY | O_NONBLOCK | O_CREAT, 0600, &attr);
+        if (worker_queue->mq == (mqd_t)-1) {
+            perror("mq_open (result queue)");
+            exit(EXIT_FAILURE);
+        }
+
+        fflush(stdout); // Do not let the child inherit and re-print buffered output
         pid_t pid = fork();
         if (pid == 0) {
             // Child process
-            char result_queue_name[RESULT_QUEUE_NAME_MAX_LEN];
-            snprintf(result_queue_name, RESULT_QUEUE_NAME_MAX_LEN, "/result_queue_%d_%d", getpid(), n);
-
-            // Create result queue for the child
-            mqd_t result_queue = mq_open(result_queue_name, O_RDWR | O_CREAT, 0600, NULL);
+            mqd_t result_queue = mq_open(worker_queue->queue_name, O_WRONLY);
             if (result_queue == (mqd_t)-1) {
                 perror("mq_open (child result queue)");
                 exit(EXIT_FAILURE);
             }
 
-            // Set up the notification for the result queue
+            // Worker process work
+            child_work(task_queue, result_queue, threads);
+            mq_close(result_queue);
+            exit(0);
+        } else if (pid > 0) {
+            // Parent process - set up the notification for the result queue
             struct sigevent sev;
+            memset(&sev, 0, sizeof(sev));
             sev.sigev_notify = SIGEV_THREAD;
             sev.sigev_notify_function = message_handler;
             sev.sigev_notify_attributes = NULL;
-            sev.sigev_value.sival_ptr = &worker_queues[n - 1];
+            sev.sigev_value.sival_ptr = worker_queue;
 
-            if (mq_notify(result_queue, &sev) == -1) {
-                perror("mq_notify (child)");
-                exit(EXIT_FAILURE);
-            }
-
-            // Worker process work
-            child_work(task_queue, result_queue);
-            exit(0);
-        } else if (pid > 0) {
-            // Parent process
-            snprintf(worker_queues[n - 1].queue_name, RESULT_QUEUE_NAME_MAX_LEN, "/result_queue_%d_%d", pid, n);
-            worker_queues[n - 1].mq = mq_open(worker_queues[n - 1].queue_name, O_RDONLY);
-            if (worker_queues[n - 1].mq == (mqd_t)-1) {
-                perror("mq_open (parent)");
+            if (mq_notify(worker_queue->mq, &sev) == -1) {
+                perror("mq_notify (parent)");
                 exit(1);
             }
 
@@ -158,35 +986,298 @@ void create_children(int n, mqd_t task_queue, WorkerQueue *worker_queues) {
     }
 }
 
+// Function to create the task queue with messages of task_msg_size bytes
+mqd_t open_task_queue(const char *name) {
+    struct mq_attr attr = {.mq_maxmsg = MAX_MSG_COUNT, .mq_msgsize = task_msg_size};
+    mqd_t task_queue = mq_open(name, O_RDWR | O_CREAT, 0600, &attr);
+    if (task_queue == (mqd_t)-1) {
+        perror("mq_open (task queue)");
+        exit(EXIT_FAILURE);
+    }
+    return task_queue;
+}
+
+// Function to drain, close and unlink the result queues of all workers
+void close_worker_queues(int n, WorkerQueue *worker_queues) {
+    for (int i = 0; i < n; i++) {
+        drain_results(&worker_queues[i]);
+        mq_close(worker_queues[i].mq);
+        mq_unlink(worker_queues[i].queue_name);
+    }
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+// Function to read a percentile from a sorted array of latencies
+double percentile_ms(long *sorted, long count, double p) {
+    if (count == 0)
+        return 0.0;
+    long idx = (long)(p * count + 0.999999) - 1;
+    if (idx < 0)
+        idx = 0;
+    if (idx >= count)
+        idx = count - 1;
+    return sorted[idx] / 1e6;
+}
+
+long received_count(void) {
+    pthread_mutex_lock(&stats_mutex);
+    long received = results_received;
+    pthread_mutex_unlock(&stats_mutex);
+    return received;
+}
+
+// Function to run one benchmark configuration and print a result row
+void run_benchmark(int n, int threads, const task_config_t *config, const bench_config_t *bench) {
+    char task_queue_name[TASK_QUEUE_NAME_MAX_LEN];
+    WorkerQueue worker_queues[MAX_WORKERS];
+    long sent = 0, queue_full = 0, arena_full = 0;
+
+    task_msg_size = bench->msg_size > (int)sizeof(task_msg_t) ? bench->msg_size : (int)sizeof(task_msg_t);
+    pthread_mutex_lock(&stats_mutex);
+    memset(class_stats, 0, sizeof(class_stats));
+    results_received = 0;
+    latency_count = 0;
+    pthread_mutex_unlock(&stats_mutex);
+
+    snprintf(task_queue_name, TASK_QUEUE_NAME_MAX_LEN, "/task_queue_%d", getpid());
+    mqd_t task_queue = open_task_queue(task_queue_name);
+    create_children(n, threads, task_queue, worker_queues);
+
+    // The server sends through its own non-blocking descriptor so a full queue is counted, not waited on
+    mqd_t send_queue = mq_open(task_queue_name, O_WRONLY | O_NONBLOCK);
+    if (send_queue == (mqd_t)-1)
+        ERR("mq_open (send queue)");
+
+    // Closed loop keeps at most one full queue plus one task per thread in flight
+    long window = MAX_MSG_COUNT + n * threads;
+    if (window > PAYLOAD_SLOTS)
+        window = PAYLOAD_SLOTS;
+
+    struct timespec start, end, next;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    next = start;
+    for (long i = 0; i < bench->count; i++) {
+        if (bench->rate > 0) {
+            // Fixed rate: tasks that do not fit when their slot comes up are dropped
+            long period_ns = 1000000000L / bench->rate;
+            next.tv_nsec += period_ns;
+            next.tv_sec += next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
+            int status = add_task_to_queue(send_queue, config);
+            if (status == 0)
+                sent++;
+            else if (status == -1)
+                queue_full++;
+            else
+                arena_full++;
+            continue;
+        }
+        for (;;) {
+            while (sent - received_count() >= window)
+                sched_yield();
+            int status = add_task_to_queue(send_queue, config);
+            if (status == 0)
+                break;
+            if (status == -1)
+                queue_full++;
+            else
+                arena_full++;
+            sched_yield();
+        }
+        sent++;
+        INSTR_TICK();
+    }
+
+    // Wait for every queued task to be answered, then stop all worker threads
+    while (received_count() < sent)
+        usleep(100);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    char msg[MAX_TASK_MSG_SIZE];
+    task_msg_t stop = {.type = TASK_STOP, .handle = -1};
+    memcpy(msg, &stop, sizeof(stop));
+    for (int i = 0; i < n * threads; i++) {
+        if (mq_send(task_queue, msg, task_msg_size, 0) < 0)
+            ERR("mq_send (stop)");
+    }
+    wait_children();
+
+    mq_close(send_queue);
+    mq_close(task_queue);
+    mq_unlink(task_queue_name);
+    close_worker_queues(n, worker_queues);
+    journal_checkpoint(3 * bench->count + JOURNAL_SLACK);
+
+    long done = 0, expired = 0;
+    for (int i = 0; i < PRIORITY_COUNT; i++) {
+        done += class_stats[i].count;
+        expired += class_stats[i].expired;
+    }
+    qsort(latencies, latency_count, sizeof(long), compare_long);
+    printf("%7d %7d %8d %8ld %10.1f %9.3f %9.3f %9.3f %10ld %10ld %8ld\n", n, threads, task_msg_size, done,
+           tasks_per_sec(done, elapsed_ns(start, end)), percentile_ms(latencies, latency_count, 0.50),
+           percentile_ms(latencies, latency_count, 0.99), percentile_ms(latencies, latency_count, 0.999),
+           queue_full, arena_full, expired);
+}
+
+// Function to run the benchmark once or sweep worker counts and message sizes
+void benchmark(int n, int threads, const task_config_t *config, const bench_config_t *bench) {
+    static const int sweep_sizes[] = {64, 512, 4096};
+    latency_capacity = bench->count;
+    if ((latencies = malloc(sizeof(long) * latency_capacity)) == NULL)
+        ERR("malloc");
+
+    printf("workers threads msg_size    tasks    tasks/s    p50 ms    p99 ms   p999 ms queue_full arena_full  expired\n");
+    if (!bench->sweep) {
+        run_benchmark(n, threads, config, bench);
+    } else {
+        bench_config_t run = *bench;
+        for (int workers = MIN_WORKERS; workers <= n; workers *= 2) {
+            for (size_t i = 0; i < sizeof(sweep_sizes) / sizeof(sweep_sizes[0]); i++) {
+                run.msg_size = sweep_sizes[i];
+                run_benchmark(workers, threads, config, &run);
+            }
+        }
+    }
+    free(latencies);
+}
+
+// Function to display usage instructions
+void usage(char *name) {
+    fprintf(stderr, "USAGE: %s [-n workers] [-t threads] [-k add|vsum|dot|matmul|hash|mixed]\n", name);
+    fprintf(stderr, "       [-p bulk|normal|urgent|mixed] [-d deadline_ms]\n");
+    fprintf(stderr, "       [-B [-r rate] [-c count] [-m msg_size] [-S]] [-j journal [-g group]]\n");
+    fprintf(stderr, "workers: %d <= n <= %d (default 3), threads per worker: 1 <= t <= %d (default 1)\n",
+            MIN_WORKERS, MAX_WORKERS, MAX_THREADS);
+    fprintf(stderr, "kernel defaults to add, priority to normal, no deadline by default\n");
+    fprintf(stderr, "-B: benchmark, rate 0 (default) is closed loop, %d tasks per run, -S sweeps workers and sizes\n",
+            BENCH_DEFAULT_COUNT);
+    fprintf(stderr, "-j: journal tasks to a file and recover unfinished ones, fsync every %d records by default\n",
+            JOURNAL_DEFAULT_GROUP);
+    exit(EXIT_FAILURE);
+}
+
 int main(int argc, char **argv) {
     int n = 3; // Number of workers (children)
+    int threads = 1; // Threads per worker process
+    task_config_t config = {.task_type = TASK_ADD, .priority = PRIORITY_NORMAL, .deadline_ms = 0};
+    bench_config_t bench = {.rate = 0, .count = BENCH_DEFAULT_COUNT, .msg_size = 0, .sweep = 0};
+    char *journal_path = NULL;
+    long journal_group = JOURNAL_DEFAULT_GROUP;
+
+    int option;
+    while ((option = getopt(argc, argv, "n:t:k:p:d:Br:c:m:Sj:g:")) != -1) {
+        switch (option) {
+            case 'n':
+                n = atoi(optarg);
+                if (n < MIN_WORKERS || n > MAX_WORKERS)
+                    usage(argv[0]);
+                break;
+            case 't':
+                threads = atoi(optarg);
+                if (threads < 1 || threads > MAX_THREADS)
+                    usage(argv[0]);
+                break;
+            case 'k':
+                if ((config.task_type = find_task_type(optarg)) < -1)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if ((config.priority = find_priority(optarg)) < -1)
+                    usage(argv[0]);
+                break;
+            case 'd':
+                config.deadline_ms = atol(optarg);
+                if (config.deadline_ms < 0)
+                    usage(argv[0]);
+                break;
+            case 'B':
+                bench_mode = 1;
+                break;
+            case 'r':
+                if ((bench.rate = atol(optarg)) < 0)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                if ((bench.count = atol(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            case 'm':
+                bench.msg_size = atoi(optarg);
+                if (bench.msg_size < 0 || bench.msg_size > MAX_TASK_MSG_SIZE)
+                    usage(argv[0]);
+                break;
+            case 'S':
+                bench.sweep = 1;
+                break;
+            case 'j':
+                journal_path = optarg;
+                if (strlen(journal_path) >= sizeof(((journal_t *)0)->path))
+                    usage(argv[0]);
+                break;
+            case 'g':
+                if ((journal_group = atol(optarg)) <= 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
 
     printf("Server is starting...\n");
+    srand(getpid());
+
+    // Payload arena is mapped before fork so every worker resolves the same handles
+    payload_arena = mmap(NULL, sizeof(payload_slot_t) * PAYLOAD_SLOTS, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (payload_arena == MAP_FAILED)
+        ERR("mmap");
+
+    // The journal is mapped before fork as well, workers append their acknowledgements to it
+    if (journal_path != NULL) {
+        long tasks = bench_mode ? bench.count : (long)n * threads * MAX_TASK_COUNT;
+        journal_open(journal_path, 3 * tasks + JOURNAL_SLACK, journal_group);
+    }
+
+    if (bench_mode) {
+        benchmark(n, threads, &config, &bench);
+        journal_close();
+        if (journal_path != NULL)
+            printf("Journal: %ld group commits\n", total_journal_commits);
+        free(recovered_tasks);
+        munmap(payload_arena, sizeof(payload_slot_t) * PAYLOAD_SLOTS);
+        return EXIT_SUCCESS;
+    }
 
     mqd_t task_queue;
     char task_queue_name[TASK_QUEUE_NAME_MAX_LEN];
     snprintf(task_queue_name, TASK_QUEUE_NAME_MAX_LEN, "/task_queue_%d", getpid());
-    task_queue = mq_open(task_queue_name, O_RDWR | O_CREAT, 0600, NULL);
-    if (task_queue == (mqd_t)-1) {
-        perror("mq_open (task queue)");
-        exit(EXIT_FAILURE);
-    }
+    task_queue = open_task_queue(task_queue_name);
 
     WorkerQueue worker_queues[MAX_WORKERS];
 
     // Create child worker processes
-    create_children(n, task_queue, worker_queues);
+    create_children(n, threads, task_queue, worker_queues);
     // Parent process manages tasks and workers
-    parent_work(n, task_queue);
+    parent_work(n, threads, task_queue, &config);
 
     printf("Server shutting down...\n");
 
     // Clean up resources
     mq_close(task_queue);
-    for (int i = 0; i < n; i++) {
-        mq_close(worker_queues[i].mq);
-        mq_unlink(worker_queues[i].queue_name);
-    }
+    mq_unlink(task_queue_name);
+    close_worker_queues(n, worker_queues);
+    print_class_stats();
+    journal_checkpoint(JOURNAL_SLACK);
+    journal_close();
+    free(recovered_tasks);
+    munmap(payload_arena, sizeof(payload_slot_t) * PAYLOAD_SLOTS);
 
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,811 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <mqueue.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+
+#define MAX_WORKERS 16          // Producers or consumers of one run
+#define MAX_LIST 16             // Values of a comma separated option
+#define QUEUE_DEPTH 64          // Slots of the shared memory ring and of the in-process queues
+#define MQ_DEPTH 10             // Messages of a POSIX queue, the default /proc/sys/fs/mqueue/msg_max
+#define DEFAULT_MESSAGES 10000  // Messages sent by every producer
+#define SPIN_LIMIT 100          // Polls of the shared memory ring before the CPU is yielded
+#define CACHE_LINE 64
+#define SUB_BITS 4              // Latency histogram with 16 buckets per power of two
+#define SUB (1 << SUB_BITS)
+#define BUCKETS (64 * SUB)
+
+// Start of every message; the rest of the message is payload
+typedef struct
+{
+    uint64_t sent_ns;   // CLOCK_MONOTONIC, comparable between processes
+    uint32_t stop;      // Sent by the parent, one per consumer, once all producers are done
+    uint32_t producer;
+} msg_header_t;
+
+// Measurements of one consumer
+typedef struct
+{
+    uint64_t received;
+    uint64_t last_ns;   // Arrival of the last message
+    uint64_t histogram[BUCKETS];
+} consumer_result_t;
+
+// Head and tail of the shared memory ring, on separate cache lines; the slots follow
+typedef struct
+{
+    uint64_t head __attribute__((aligned(CACHE_LINE)));
+    uint64_t tail __attribute__((aligned(CACHE_LINE)));
+} ring_t;
+
+// Bounded queue handing messages between threads
+typedef struct
+{
+    pthread_mutex_t mutex;
+    pthread_cond_t not_empty, not_full;
+    sem_t slots, items, lock;
+    int head, tail, count;
+    char *data;
+} queue_t;
+
+struct transport;
+
+// State of one run, mapped shared so processes and threads see the same copy
+typedef struct
+{
+    const struct transport *transport;
+    size_t size;
+    int producers, consumers;
+    long messages;
+    long interval_ns;
+    int ready;   // Workers ready to start
+    int go;      // Set by the parent to release the producers
+    pid_t consumer_pids[MAX_WORKERS];
+    int fds[2];  // Pipe or socket pair, producers write fds[1] and consumers read fds[0]
+    mqd_t mq;
+    ring_t *ring;
+    size_t stride;
+    queue_t queue;
+    consumer_result_t results[MAX_WORKERS];
+} bench_t;
+
+// One IPC mechanism
+typedef struct transport
+{
+    const char *name;
+    int threads;        // Workers are threads of one process instead of processes
+    size_t fixed_size;  // Size of every message when the mechanism carries no payload, 0 otherwise
+    int (*setup)(bench_t *b);  // Returns -1 when the configuration cannot run
+    void (*send)(bench_t *b, int consumer, char *msg);
+    void (*receive)(bench_t *b, char *msg);
+    void (*teardown)(bench_t *b);
+} transport_t;
+
+typedef void (*worker_fn)(bench_t *b, int index);
+
+typedef struct
+{
+    bench_t *b;
+    worker_fn fn;
+    int index;
+    pthread_t tid;
+    pid_t pid;
+} worker_t;
+
+uint64_t now_ns(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+// Function mapping a latency to its histogram bucket: exact below SUB, then SUB buckets per power of two
+int bucket(uint64_t value)
+{
+    if (value < SUB)
+        return value;
+    int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+    return (shift + 1) * SUB + ((value >> shift) & (SUB - 1));
+}
+
+// Function returning the middle of the values a bucket holds
+double bucket_value(int index)
+{
+    if (index < SUB)
+        return index;
+    int shift = index / SUB - 1;
+    return ((uint64_t)(SUB + index % SUB) << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+// Function to write a whole buffer, retrying after short writes and interrupts
+void bulk_write(int fd, char *buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(fd, buf, size));
+        if (c < 0)
+            ERR("write");
+        buf += c;
+        size -= c;
+    }
+}
+
+// Function to read a whole buffer, retrying after short reads and interrupts
+void bulk_read(int fd, char *buf, size_t size)
+{
+    while (size > 0)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(read(fd, buf, size));
+        if (c < 0)
+            ERR("read");
+        if (c == 0)
+        {
+            fprintf(stderr, "sop-ipcb: unexpected end of stream\n");
+            exit(EXIT_FAILURE);
+        }
+        buf += c;
+        size -= c;
+    }
+}
+
+// Function to report a configuration a transport cannot run
+int skip(bench_t *b, const char *reason)
+{
+    fprintf(stderr, "sop-ipcb: skipping %s with %zu B messages, %d producers and %d consumers: %s\n",
+            b->transport->name, b->size, b->producers, b->consumers, reason);
+    return -1;
+}
+
+// Pipe: writes up to PIPE_BUF are atomic, larger messages are only kept whole by a single writer and reader
+int pipe_setup(bench_t *b)
+{
+    if (b->size > PIPE_BUF && (b->producers > 1 || b->consumers > 1))
+        return skip(b, "messages over PIPE_BUF interleave with several producers or consumers");
+    int fds[2];
+    if (pipe(fds))
+        ERR("pipe");
+    b->fds[0] = fds[0];
+    b->fds[1] = fds[1];
+    return 0;
+}
+
+// Unix socket: a SOCK_SEQPACKET pair keeps message boundaries for any number of writers and readers
+int unix_setup(bench_t *b)
+{
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, b->fds))
+        ERR("socketpair");
+    int buffer = QUEUE_DEPTH * (int)b->size;
+    setsockopt(b->fds[1], SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    return 0;
+}
+
+void fd_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    bulk_write(b->fds[1], msg, b->size);
+}
+
+void fd_receive(bench_t *b, char *msg) { bulk_read(b->fds[0], msg, b->size); }
+
+void fd_teardown(bench_t *b)
+{
+    if (TEMP_FAILURE_RETRY(close(b->fds[0])) || TEMP_FAILURE_RETRY(close(b->fds[1])))
+        ERR("close");
+}
+
+// POSIX message queue; the name is unlinked at once, the inherited descriptors keep the queue alive
+int mq_setup(bench_t *b)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/sop-ipcb-%d", getpid());
+    struct mq_attr attr = {.mq_maxmsg = MQ_DEPTH, .mq_msgsize = b->size};
+    if ((b->mq = mq_open(name, O_CREAT | O_EXCL | O_RDWR, 0600, &attr)) == (mqd_t)-1)
+    {
+        if (errno == EINVAL || errno == ENOMEM || errno == EMFILE)
+            return skip(b, "over the limits in /proc/sys/fs/mqueue");
+        ERR("mq_open");
+    }
+    if (mq_unlink(name))
+        ERR("mq_unlink");
+    return 0;
+}
+
+void mq_transport_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    while (mq_send(b->mq, msg, b->size, 0))
+        if (errno != EINTR)
+            ERR("mq_send");
+}
+
+void mq_transport_receive(bench_t *b, char *msg)
+{
+    while (mq_receive(b->mq, msg, b->size, NULL) < 0)
+        if (errno != EINTR)
+            ERR("mq_receive");
+}
+
+void mq_teardown(bench_t *b)
+{
+    if (mq_close(b->mq))
+        ERR("mq_close");
+}
+
+// Signals: a queued SIGRTMIN per message carries the low 32 bits of the send time as its value, which is
+// enough for latencies under 4 s. The stop is SIGRTMIN+1, delivered only after every pending SIGRTMIN
+int signal_setup(bench_t *b)
+{
+    (void)b;
+    return 0;
+}
+
+void signal_send(bench_t *b, int consumer, char *msg)
+{
+    msg_header_t *header = (msg_header_t *)msg;
+    union sigval value = {.sival_int = (int)(uint32_t)header->sent_ns};
+    // The queue of pending signals is bounded by RLIMIT_SIGPENDING, a full queue is waited out
+    while (sigqueue(b->consumer_pids[consumer], header->stop ? SIGRTMIN + 1 : SIGRTMIN, value))
+    {
+        if (errno != EAGAIN)
+            ERR("sigqueue");
+        sched_yield();
+    }
+}
+
+void signal_receive(bench_t *b, char *msg)
+{
+    (void)b;
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGRTMIN + 1);
+    siginfo_t info;
+    while (sigwaitinfo(&mask, &info) < 0)
+        if (errno != EINTR)
+            ERR("sigwaitinfo");
+    uint64_t now = now_ns();
+    msg_header_t *header = (msg_header_t *)msg;
+    header->stop = info.si_signo != SIGRTMIN;
+    header->sent_ns = now - (uint32_t)((uint32_t)now - (uint32_t)info.si_value.sival_int);
+}
+
+void signal_teardown(bench_t *b) { (void)b; }
+
+// Shared memory: a bounded multi-producer multi-consumer ring where every slot carries a sequence number
+// telling whose turn it is, so producers and consumers only contend on claiming a position
+uint64_t *ring_slot(bench_t *b, uint64_t position)
+{
+    return (uint64_t *)((char *)(b->ring + 1) + position % QUEUE_DEPTH * b->stride);
+}
+
+int ring_setup(bench_t *b)
+{
+    b->stride = (sizeof(uint64_t) + b->size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+    b->ring = mmap(NULL, sizeof(ring_t) + QUEUE_DEPTH * b->stride, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b->ring == MAP_FAILED)
+        ERR("mmap");
+    for (uint64_t i = 0; i < QUEUE_DEPTH; i++)
+        *ring_slot(b, i) = i;
+    return 0;
+}
+
+// Function to spin a while on a busy ring, then give the CPU to the other side
+void ring_backoff(int *spins)
+{
+    if (++*spins >= SPIN_LIMIT)
+    {
+        sched_yield();
+        *spins = 0;
+    }
+}
+
+void ring_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    int spins = 0;
+    uint64_t position = __atomic_load_n(&b->ring->head, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint64_t *slot = ring_slot(b, position);
+        int64_t turn = __atomic_load_n(slot, __ATOMIC_ACQUIRE) - position;
+        if (turn == 0)
+        {
+            if (__atomic_compare_exchange_n(&b->ring->head, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                memcpy(slot + 1, msg, b->size);
+                __atomic_store_n(slot, position + 1, __ATOMIC_RELEASE);
+                return;
+            }
+            continue;
+        }
+        // A slot a lap behind is still waiting for its consumer: the ring is full
+        if (turn < 0)
+            ring_backoff(&spins);
+        position = __atomic_load_n(&b->ring->head, __ATOMIC_RELAXED);
+    }
+}
+
+void ring_receive(bench_t *b, char *msg)
+{
+    int spins = 0;
+    uint64_t position = __atomic_load_n(&b->ring->tail, __ATOMIC_RELAXED);
+    for (;;)
+    {
+        uint64_t *slot = ring_slot(b, position);
+        int64_t turn = __atomic_load_n(slot, __ATOMIC_ACQUIRE) - (position + 1);
+        if (turn == 0)
+        {
+            if (__atomic_compare_exchange_n(&b->ring->tail, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED))
+            {
+                memcpy(msg, slot + 1, b->size);
+                __atomic_store_n(slot, position + QUEUE_DEPTH, __ATOMIC_RELEASE);
+                return;
+            }
+            continue;
+        }
+        // A slot not yet filled: the ring is empty
+        if (turn < 0)
+            ring_backoff(&spins);
+        position = __atomic_load_n(&b->ring->tail, __ATOMIC_RELAXED);
+    }
+}
+
+void ring_teardown(bench_t *b)
+{
+    if (munmap(b->ring, sizeof(ring_t) + QUEUE_DEPTH * b->stride))
+        ERR("munmap");
+}
+
+// In-process queue shared by the mutex, condition variable and semaphore handoffs
+int queue_setup(bench_t *b)
+{
+    queue_t *q = &b->queue;
+    if ((errno = pthread_mutex_init(&q->mutex, NULL)) || (errno = pthread_cond_init(&q->not_empty, NULL)) ||
+        (errno = pthread_cond_init(&q->not_full, NULL)))
+        ERR("pthread_mutex_init");
+    if (sem_init(&q->slots, 0, QUEUE_DEPTH) || sem_init(&q->items, 0, 0) || sem_init(&q->lock, 0, 1))
+        ERR("sem_init");
+    q->head = q->tail = q->count = 0;
+    if (!(q->data = malloc(QUEUE_DEPTH * b->size)))
+        ERR("malloc");
+    return 0;
+}
+
+void queue_put(bench_t *b, char *msg)
+{
+    queue_t *q = &b->queue;
+    memcpy(q->data + q->head * b->size, msg, b->size);
+    q->head = (q->head + 1) % QUEUE_DEPTH;
+    q->count++;
+}
+
+void queue_take(bench_t *b, char *msg)
+{
+    queue_t *q = &b->queue;
+    memcpy(msg, q->data + q->tail * b->size, b->size);
+    q->tail = (q->tail + 1) % QUEUE_DEPTH;
+    q->count--;
+}
+
+// Mutex only: a full or empty queue is polled, the way the video player's circular buffer does it
+void mutex_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    for (;;)
+    {
+        pthread_mutex_lock(&b->queue.mutex);
+        if (b->queue.count < QUEUE_DEPTH)
+        {
+            queue_put(b, msg);
+            pthread_mutex_unlock(&b->queue.mutex);
+            return;
+        }
+        pthread_mutex_unlock(&b->queue.mutex);
+        sched_yield();
+    }
+}
+
+void mutex_receive(bench_t *b, char *msg)
+{
+    for (;;)
+    {
+        pthread_mutex_lock(&b->queue.mutex);
+        if (b->queue.count > 0)
+        {
+            queue_take(b, msg);
+            pthread_mutex_unlock(&b->queue.mutex);
+            return;
+        }
+        pthread_mutex_unlock(&b->queue.mutex);
+        sched_yield();
+    }
+}
+
+// Condition variables: a thread sleeps until the other side changes the queue
+void condvar_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    pthread_mutex_lock(&b->queue.mutex);
+    while (b->queue.count == QUEUE_DEPTH)
+        pthread_cond_wait(&b->queue.not_full, &b->queue.mutex);
+    queue_put(b, msg);
+    pthread_cond_signal(&b->queue.not_empty);
+    pthread_mutex_unlock(&b->queue.mutex);
+}
+
+void condvar_receive(bench_t *b, char *msg)
+{
+    pthread_mutex_lock(&b->queue.mutex);
+    while (b->queue.count == 0)
+        pthread_cond_wait(&b->queue.not_empty, &b->queue.mutex);
+    queue_take(b, msg);
+    pthread_cond_signal(&b->queue.not_full);
+    pthread_mutex_unlock(&b->queue.mutex);
+}
+
+// Semaphores: counting semaphores for free slots and items, a binary one guarding the indices
+void sem_wait_retry(sem_t *sem)
+{
+    while (sem_wait(sem))
+        if (errno != EINTR)
+            ERR("sem_wait");
+}
+
+void semaphore_send(bench_t *b, int consumer, char *msg)
+{
+    (void)consumer;
+    sem_wait_retry(&b->queue.slots);
+    sem_wait_retry(&b->queue.lock);
+    queue_put(b, msg);
+    sem_post(&b->queue.lock);
+    sem_post(&b->queue.items);
+}
+
+void semaphore_receive(bench_t *b, char *msg)
+{
+    sem_wait_retry(&b->queue.items);
+    sem_wait_retry(&b->queue.lock);
+    queue_take(b, msg);
+    sem_post(&b->queue.lock);
+    sem_post(&b->queue.slots);
+}
+
+void queue_teardown(bench_t *b)
+{
+    queue_t *q = &b->queue;
+    pthread_mutex_destroy(&q->mutex);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    sem_destroy(&q->slots);
+    sem_destroy(&q->items);
+    sem_destroy(&q->lock);
+    free(q->data);
+}
+
+const transport_t transports[] = {
+    {"pipe", 0, 0, pipe_setup, fd_send, fd_receive, fd_teardown},
+    {"mqueue", 0, 0, mq_setup, mq_transport_send, mq_transport_receive, mq_teardown},
+    {"signal", 0, sizeof(int), signal_setup, signal_send, signal_receive, signal_teardown},
+    {"unix", 0, 0, unix_setup, fd_send, fd_receive, fd_teardown},
+    {"shm", 0, 0, ring_setup, ring_send, ring_receive, ring_teardown},
+    {"mutex", 1, 0, queue_setup, mutex_send, mutex_receive, queue_teardown},
+    {"condvar", 1, 0, queue_setup, condvar_send, condvar_receive, queue_teardown},
+    {"semaphore", 1, 0, queue_setup, semaphore_send, semaphore_receive, queue_teardown},
+};
+#define TRANSPORT_COUNT ((int)(sizeof(transports) / sizeof(transports[0])))
+
+// Function allocating a message buffer, never smaller than the header
+char *message_buffer(bench_t *b)
+{
+    size_t size = b->size > sizeof(msg_header_t) ? b->size : sizeof(msg_header_t);
+    char *msg = calloc(1, size);
+    if (!msg)
+        ERR("calloc");
+    return msg;
+}
+
+// Function executed by producers: sends its messages, stamped with the send time, once released
+void producer(bench_t *b, int index)
+{
+    char *msg = message_buffer(b);
+    memset(msg, 'a' + index % 26, b->size);
+    msg_header_t *header = (msg_header_t *)msg;
+    header->stop = 0;
+    header->producer = index;
+
+    __atomic_add_fetch(&b->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&b->go, __ATOMIC_ACQUIRE))
+        sched_yield();
+
+    struct timespec next;
+    clock_gettime(CLOCK_MONOTONIC, &next);
+    for (long i = 0; i < b->messages; i++)
+    {
+        if (b->interval_ns)
+        {
+            next.tv_nsec += b->interval_ns;
+            next.tv_sec += next.tv_nsec / 1000000000L;
+            next.tv_nsec %= 1000000000L;
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) == EINTR)
+                ;
+        }
+        header->sent_ns = now_ns();
+        b->transport->send(b, (index + i) % b->consumers, msg);
+    }
+    free(msg);
+}
+
+// Function executed by consumers: records the latency of every message until its stop arrives
+void consumer(bench_t *b, int index)
+{
+    char *msg = message_buffer(b);
+    msg_header_t *header = (msg_header_t *)msg;
+    consumer_result_t *result = &b->results[index];
+    __atomic_add_fetch(&b->ready, 1, __ATOMIC_RELEASE);
+    for (;;)
+    {
+        b->transport->receive(b, msg);
+        if (header->stop)
+            break;
+        uint64_t now = now_ns();
+        result->histogram[bucket(now - header->sent_ns)]++;
+        result->received++;
+        result->last_ns = now;
+    }
+    free(msg);
+}
+
+void *worker_thread(void *arg)
+{
+    worker_t *worker = (worker_t *)arg;
+    worker->fn(worker->b, worker->index);
+    return NULL;
+}
+
+// Function to start a producer or consumer as a thread or a process, depending on the transport
+void start_worker(worker_t *worker)
+{
+    if (worker->b->transport->threads)
+    {
+        if ((errno = pthread_create(&worker->tid, NULL, worker_thread, worker)))
+            ERR("pthread_create");
+        return;
+    }
+    if ((worker->pid = fork()) < 0)
+        ERR("fork");
+    if (worker->pid == 0)
+    {
+        worker->fn(worker->b, worker->index);
+        exit(EXIT_SUCCESS);
+    }
+}
+
+void join_worker(worker_t *worker)
+{
+    if (worker->b->transport->threads)
+    {
+        if ((errno = pthread_join(worker->tid, NULL)))
+            ERR("pthread_join");
+        return;
+    }
+    int status;
+    if (TEMP_FAILURE_RETRY(waitpid(worker->pid, &status, 0)) < 0)
+        ERR("waitpid");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS)
+    {
+        fprintf(stderr, "sop-ipcb: worker %d failed\n", worker->pid);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to run one configuration and print its CSV row
+void run(bench_t *b, const transport_t *transport, size_t size, int producers, int consumers, long messages,
+         long interval_ns)
+{
+    memset(b, 0, sizeof(bench_t));
+    b->transport = transport;
+    b->size = size;
+    b->producers = producers;
+    b->consumers = consumers;
+    b->messages = messages;
+    b->interval_ns = interval_ns;
+    if (transport->setup(b))
+        return;
+
+    // Buffered output would be flushed again by every forked worker
+    fflush(stdout);
+    worker_t workers[2 * MAX_WORKERS];
+    for (int i = 0; i < consumers + producers; i++)
+    {
+        workers[i] = (worker_t){.b = b, .fn = i < consumers ? consumer : producer,
+                                .index = i < consumers ? i : i - consumers};
+        start_worker(&workers[i]);
+        if (i < consumers)
+            b->consumer_pids[i] = workers[i].pid;
+    }
+    while (__atomic_load_n(&b->ready, __ATOMIC_ACQUIRE) < consumers + producers)
+        sched_yield();
+    uint64_t start = now_ns();
+    __atomic_store_n(&b->go, 1, __ATOMIC_RELEASE);
+
+    for (int i = consumers; i < consumers + producers; i++)
+        join_worker(&workers[i]);
+    // Every data message is queued before the stops, so each consumer drains its share and takes one stop
+    char *stop = message_buffer(b);
+    ((msg_header_t *)stop)->stop = 1;
+    for (int i = 0; i < consumers; i++)
+    {
+        ((msg_header_t *)stop)->sent_ns = now_ns();
+        transport->send(b, i, stop);
+    }
+    free(stop);
+    for (int i = 0; i < consumers; i++)
+        join_worker(&workers[i]);
+    transport->teardown(b);
+
+    uint64_t received = 0, last = start;
+    static uint64_t histogram[BUCKETS];
+    memset(histogram, 0, sizeof(histogram));
+    for (int i = 0; i < consumers; i++)
+    {
+        received += b->results[i].received;
+        if (b->results[i].last_ns > last)
+            last = b->results[i].last_ns;
+        for (int j = 0; j < BUCKETS; j++)
+            histogram[j] += b->results[i].histogram[j];
+    }
+    if (received != (uint64_t)producers * messages)
+    {
+        fprintf(stderr, "sop-ipcb: %s lost messages: %lu of %lu received\n", transport->name,
+                (unsigned long)received, (unsigned long)producers * messages);
+        exit(EXIT_FAILURE);
+    }
+
+    const double quantiles[] = {0.5, 0.99, 0.999, 1.0};
+    double at[4], sum = 0;
+    uint64_t seen = 0;
+    for (int j = 0, q = 0; j < BUCKETS; j++)
+    {
+        seen += histogram[j];
+        sum += histogram[j] * bucket_value(j);
+        while (q < 4 && histogram[j] && seen >= quantiles[q] * received)
+            at[q++] = bucket_value(j) / 1e3;
+    }
+    double seconds = (last - start) / 1e9;
+    printf("%s,%zu,%d,%d,%lu,%.6f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n", transport->name, size, producers,
+           consumers, (unsigned long)received, seconds, received / seconds, received * size / seconds / 1e6,
+           sum / received / 1e3, at[0], at[1], at[2], at[3]);
+    fflush(stdout);
+}
+
+// Function to parse a comma separated list of positive numbers, returns how many there were
+int parse_list(char *text, long *values)
+{
+    int count = 0;
+    char *saveptr;
+    for (char *item = strtok_r(text, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr))
+    {
+        if (count == MAX_LIST || (values[count++] = atol(item)) < 1)
+            return -1;
+    }
+    return count;
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-t transport,...] [-s size,...] [-p producers,...] [-c consumers,...] "
+                    "[-n messages] [-i interval_us]\n", name);
+    fprintf(stderr, "transports:");
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
+        fprintf(stderr, " %s", transports[i].name);
+    fprintf(stderr, "\nsizes of at least %zu bytes, at most %d producers and consumers\n", sizeof(msg_header_t),
+            MAX_WORKERS);
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char **argv)
+{
+    int selected[TRANSPORT_COUNT];
+    int selected_count = TRANSPORT_COUNT;
+    for (int i = 0; i < TRANSPORT_COUNT; i++)
+        selected[i] = i;
+    long sizes[MAX_LIST] = {16, 64, 512, 4096, 65536}, producers[MAX_LIST] = {1, 4}, consumers[MAX_LIST] = {1, 4};
+    int size_count = 5, producer_count = 2, consumer_count = 2;
+    long messages = DEFAULT_MESSAGES, interval_us = 0;
+
+    int c;
+    while ((c = getopt(argc, argv, "t:s:p:c:n:i:")) != -1)
+    {
+        switch (c)
+        {
+        case 't':
+            selected_count = 0;
+            for (char *name = strtok(optarg, ","); name; name = strtok(NULL, ","))
+            {
+                int i;
+                for (i = 0; i < TRANSPORT_COUNT && strcmp(transports[i].name, name); i++)
+                    ;
+                if (i == TRANSPORT_COUNT || selected_count == TRANSPORT_COUNT)
+                    usage(argv[0]);
+                selected[selected_count++] = i;
+            }
+            break;
+        case 's':
+            size_count = parse_list(optarg, sizes);
+            break;
+        case 'p':
+            producer_count = parse_list(optarg, producers);
+            break;
+        case 'c':
+            consumer_count = parse_list(optarg, consumers);
+            break;
+        case 'n':
+            messages = atol(optarg);
+            break;
+        case 'i':
+            interval_us = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc || size_count < 1 || producer_count < 1 || consumer_count < 1 || messages < 1 ||
+        interval_us < 0)
+        usage(argv[0]);
+    for (int i = 0; i < size_count; i++)
+        if (sizes[i] < (long)sizeof(msg_header_t))
+            usage(argv[0]);
+    for (int i = 0; i < producer_count; i++)
+        if (producers[i] > MAX_WORKERS)
+            usage(argv[0]);
+    for (int i = 0; i < consumer_count; i++)
+        if (consumers[i] > MAX_WORKERS)
+            usage(argv[0]);
+
+    // Blocked before any worker exists, so queued signals wait for sigwaitinfo in the consumers
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGRTMIN + 1);
+    if (sigprocmask(SIG_BLOCK, &mask, NULL))
+        ERR("sigprocmask");
+
+    bench_t *b = mmap(NULL, sizeof(bench_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+        ERR("mmap");
+    printf("transport,size,producers,consumers,messages,seconds,msgs_per_s,mb_per_s,"
+           "lat_mean_us,lat_p50_us,lat_p99_us,lat_p999_us,lat_max_us\n");
+    for (int t = 0; t < selected_count; t++)
+    {
+        const transport_t *transport = &transports[selected[t]];
+        // A transport without payload runs once, at the size of what it carries
+        int runs = transport->fixed_size ? 1 : size_count;
+        for (int s = 0; s < runs; s++)
+            for (int p = 0; p < producer_count; p++)
+                for (int k = 0; k < consumer_count; k++)
+                    run(b, transport, transport->fixed_size ? transport->fixed_size : (size_t)sizes[s], producers[p],
+                        consumers[k], messages, interval_us * 1000);
+    }
+    if (munmap(b, sizeof(bench_t)))
+        ERR("munmap");
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,346 @@
+// Hot-path instrumentation shared by the programs of this repository: per-thread counters, scoped timers
+// and log-linear latency histograms, dumped periodically or at exit, optionally mirrored to the ftrace
+// trace_marker. Everything compiles to nothing unless SOP_INSTR is defined.
+#ifndef SOP_INSTR_H
+#define SOP_INSTR_H
+
+#ifdef SOP_INSTR
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(SOP_INSTR_TSC) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#define INSTR_USE_TSC
+#endif
+
+#define INSTR_MAX_METRICS 32
+#define INSTR_SUB_BITS 4                      // 16 sub-buckets per power of two, values within 1/16
+#define INSTR_SUB (1 << INSTR_SUB_BITS)
+#define INSTR_BUCKETS (64 * INSTR_SUB)
+#define INSTR_TRACE_LINE 128
+
+// Kinds of metrics
+#define INSTR_KIND_COUNTER 0  // Sum of increments
+#define INSTR_KIND_TIMER 1    // Histogram of durations in clock ticks
+#define INSTR_KIND_VALUE 2    // Histogram of values recorded as they are
+
+// Metrics of one thread; written only by that thread, read by whichever thread dumps
+typedef struct instr_thread {
+    uint64_t counters[INSTR_MAX_METRICS];
+    uint64_t *histograms[INSTR_MAX_METRICS]; // INSTR_BUCKETS each, allocated on the first record
+    struct instr_thread *next;
+} instr_thread_t;
+
+// Timer started by INSTR_SCOPE and recorded when its scope is left
+typedef struct {
+    uint64_t start;
+    int id;
+} instr_scope_t;
+
+static struct {
+    pthread_mutex_t lock;
+    const char *names[INSTR_MAX_METRICS];
+    int kinds[INSTR_MAX_METRICS];
+    int count;
+    instr_thread_t *threads;      // Blocks of all threads that recorded something, never freed
+    int initialized;
+    uint64_t start_ticks;
+    struct timespec start_time;
+    uint64_t interval_ticks;      // Time between periodic dumps, 0 for a dump at exit only
+    uint64_t next_dump;
+    int trace_fd;                 // trace_marker, -1 unless SOP_INSTR_TRACE is set
+} instr_state = {.lock = PTHREAD_MUTEX_INITIALIZER, .trace_fd = -1};
+
+static __thread instr_thread_t *instr_self;
+
+// Function returning the current time in clock ticks: TSC cycles with SOP_INSTR_TSC, nanoseconds otherwise
+static inline uint64_t instr_ticks(void)
+{
+#ifdef INSTR_USE_TSC
+    return __rdtsc();
+#else
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+#endif
+}
+
+// Function returning nanoseconds per tick, measured against CLOCK_MONOTONIC since the first metric
+static double instr_ns_per_tick(void)
+{
+#ifdef INSTR_USE_TSC
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t ticks = instr_ticks() - instr_state.start_ticks;
+    double ns = (now.tv_sec - instr_state.start_time.tv_sec) * 1e9 + (now.tv_nsec - instr_state.start_time.tv_nsec);
+    return ticks ? ns / ticks : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+// Function mapping a value to its histogram bucket: exact below INSTR_SUB, then INSTR_SUB buckets per power of two
+static inline int instr_bucket(uint64_t value)
+{
+    if (value < INSTR_SUB)
+        return value;
+    int shift = 63 - __builtin_clzll(value) - INSTR_SUB_BITS;
+    return (shift + 1) * INSTR_SUB + ((value >> shift) & (INSTR_SUB - 1));
+}
+
+// Function returning the middle of the values a bucket holds
+static inline double instr_bucket_value(int bucket)
+{
+    if (bucket < INSTR_SUB)
+        return bucket;
+    int shift = bucket / INSTR_SUB - 1;
+    return ((uint64_t)(INSTR_SUB + bucket % INSTR_SUB) << shift) + ((1ULL << shift) - 1) / 2.0;
+}
+
+// Function returning the metrics block of the calling thread, created on first use
+static instr_thread_t *instr_thread(void)
+{
+    if (!instr_self)
+    {
+        instr_thread_t *self = calloc(1, sizeof(instr_thread_t));
+        if (!self)
+            abort();
+        self->next = __atomic_load_n(&instr_state.threads, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&instr_state.threads, &self->next, self, 1, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED))
+            ;
+        instr_self = self;
+    }
+    return instr_self;
+}
+
+// Function printing every metric that recorded something, summed over all threads
+static void instr_dump(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (now.tv_sec - instr_state.start_time.tv_sec) + (now.tv_nsec - instr_state.start_time.tv_nsec) / 1e9;
+    double ns_per_tick = instr_ns_per_tick();
+    uint64_t *merged = malloc(INSTR_BUCKETS * sizeof(uint64_t));
+    if (!merged)
+        return;
+    pthread_mutex_lock(&instr_state.lock);
+    for (int id = 0; id < instr_state.count; id++)
+    {
+        if (instr_state.kinds[id] == INSTR_KIND_COUNTER)
+        {
+            uint64_t total = 0;
+            for (instr_thread_t *t = __atomic_load_n(&instr_state.threads, __ATOMIC_ACQUIRE); t; t = t->next)
+                total += __atomic_load_n(&t->counters[id], __ATOMIC_RELAXED);
+            if (total)
+                fprintf(stderr, "instr[%d] %.3fs %s: %llu (%.1f/s)\n", getpid(), seconds, instr_state.names[id],
+                        (unsigned long long)total, seconds > 0 ? total / seconds : 0.0);
+            continue;
+        }
+
+        memset(merged, 0, INSTR_BUCKETS * sizeof(uint64_t));
+        uint64_t n = 0;
+        for (instr_thread_t *t = __atomic_load_n(&instr_state.threads, __ATOMIC_ACQUIRE); t; t = t->next)
+        {
+            uint64_t *h = __atomic_load_n(&t->histograms[id], __ATOMIC_ACQUIRE);
+            for (int b = 0; h && b < INSTR_BUCKETS; b++)
+            {
+                uint64_t c = __atomic_load_n(&h[b], __ATOMIC_RELAXED);
+                merged[b] += c;
+                n += c;
+            }
+        }
+        if (!n)
+            continue;
+
+        // Timers are printed in microseconds, values as recorded
+        double scale = instr_state.kinds[id] == INSTR_KIND_TIMER ? ns_per_tick / 1e3 : 1.0;
+        const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1.0};
+        double at[5], sum = 0;
+        uint64_t seen = 0;
+        int q = 0;
+        for (int b = 0; b < INSTR_BUCKETS; b++)
+        {
+            if (!merged[b])
+                continue;
+            seen += merged[b];
+            sum += merged[b] * instr_bucket_value(b);
+            while (q < 5 && seen >= quantiles[q] * n)
+                at[q++] = instr_bucket_value(b) * scale;
+        }
+        fprintf(stderr, "instr[%d] %.3fs %s: n=%llu mean=%.1f p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f%s\n",
+                getpid(), seconds, instr_state.names[id], (unsigned long long)n, sum / n * scale, at[0], at[1], at[2],
+                at[3], at[4], instr_state.kinds[id] == INSTR_KIND_TIMER ? " us" : "");
+    }
+    pthread_mutex_unlock(&instr_state.lock);
+    free(merged);
+}
+
+// Fork handlers: the child starts with empty metrics and a lock nobody holds
+static void instr_prepare(void) { pthread_mutex_lock(&instr_state.lock); }
+static void instr_parent(void) { pthread_mutex_unlock(&instr_state.lock); }
+static void instr_child(void)
+{
+    pthread_mutex_init(&instr_state.lock, NULL);
+    for (instr_thread_t *t = instr_state.threads; t; t = t->next)
+    {
+        memset(t->counters, 0, sizeof(t->counters));
+        for (int id = 0; id < INSTR_MAX_METRICS; id++)
+            if (t->histograms[id])
+                memset(t->histograms[id], 0, INSTR_BUCKETS * sizeof(uint64_t));
+    }
+    instr_state.start_ticks = instr_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &instr_state.start_time);
+    instr_state.next_dump = instr_state.start_ticks + instr_state.interval_ticks;
+}
+
+// Function to set up the library on the first metric; configured by the environment:
+// SOP_INSTR_INTERVAL=seconds for periodic dumps and SOP_INSTR_TRACE=1 for trace_marker events
+static void instr_init(void)
+{
+    instr_state.start_ticks = instr_ticks();
+    clock_gettime(CLOCK_MONOTONIC, &instr_state.start_time);
+    const char *interval = getenv("SOP_INSTR_INTERVAL");
+    if (interval && atof(interval) > 0)
+    {
+#ifdef INSTR_USE_TSC
+        // Calibrated over a short sleep, good enough to space the dumps
+        struct timespec pause = {0, 10000000};
+        uint64_t before = instr_ticks();
+        nanosleep(&pause, NULL);
+        instr_state.interval_ticks = atof(interval) * (instr_ticks() - before) / 0.01;
+#else
+        instr_state.interval_ticks = atof(interval) * 1e9;
+#endif
+        instr_state.next_dump = instr_state.start_ticks + instr_state.interval_ticks;
+    }
+    const char *trace = getenv("SOP_INSTR_TRACE");
+    if (trace && atoi(trace))
+    {
+        instr_state.trace_fd = open("/sys/kernel/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+        if (instr_state.trace_fd < 0)
+            instr_state.trace_fd = open("/sys/kernel/debug/tracing/trace_marker", O_WRONLY | O_CLOEXEC);
+    }
+    pthread_atfork(instr_prepare, instr_parent, instr_child);
+    atexit(instr_dump);
+    instr_state.initialized = 1;
+}
+
+// Function returning the id of a metric, registering it on first use
+static int instr_register(const char *name, int kind)
+{
+    pthread_mutex_lock(&instr_state.lock);
+    if (!instr_state.initialized)
+        instr_init();
+    int id;
+    for (id = 0; id < instr_state.count; id++)
+        if (strcmp(instr_state.names[id], name) == 0)
+            break;
+    if (id == instr_state.count)
+    {
+        if (id == INSTR_MAX_METRICS)
+        {
+            fprintf(stderr, "instr: more than %d metrics\n", INSTR_MAX_METRICS);
+            abort();
+        }
+        instr_state.names[id] = name;
+        instr_state.kinds[id] = kind;
+        instr_state.count++;
+    }
+    pthread_mutex_unlock(&instr_state.lock);
+    return id;
+}
+
+// Function to add to a counter of the calling thread
+static inline void instr_add(int id, uint64_t n)
+{
+    uint64_t *counter = &instr_thread()->counters[id];
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+// Function to record a value in a histogram of the calling thread
+static inline void instr_record(int id, uint64_t value)
+{
+    instr_thread_t *self = instr_thread();
+    uint64_t *h = self->histograms[id];
+    if (!h)
+    {
+        if (!(h = calloc(INSTR_BUCKETS, sizeof(uint64_t))))
+            abort();
+        __atomic_store_n(&self->histograms[id], h, __ATOMIC_RELEASE);
+    }
+    uint64_t *bucket = &h[instr_bucket(value)];
+    __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+// Function to record the time since start in a timer, and to the trace_marker when tracing
+static inline void instr_stop(int id, uint64_t start)
+{
+    uint64_t ticks = instr_ticks() - start;
+    instr_record(id, ticks);
+    if (instr_state.trace_fd >= 0)
+    {
+        char line[INSTR_TRACE_LINE];
+        int len = snprintf(line, sizeof(line), "sop_instr: %s=%.0f ns\n", instr_state.names[id],
+                           ticks * instr_ns_per_tick());
+        if (write(instr_state.trace_fd, line, len) < 0)
+            instr_state.trace_fd = -1;
+    }
+}
+
+// Cleanup handler of INSTR_SCOPE
+static inline void instr_scope_end(instr_scope_t *scope) { instr_stop(scope->id, scope->start); }
+
+// Function to dump all metrics once the interval is over; one caller wins when threads race
+static inline void instr_tick(void)
+{
+    uint64_t next = __atomic_load_n(&instr_state.next_dump, __ATOMIC_RELAXED);
+    if (!instr_state.interval_ticks || instr_ticks() < next)
+        return;
+    if (__atomic_compare_exchange_n(&instr_state.next_dump, &next, next + instr_state.interval_ticks, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        instr_dump();
+}
+
+// The id of a metric is looked up once per call site
+#define INSTR_ID(name, kind)                                             \
+    (__extension__({                                                     \
+        static int instr_id_ = -1;                                       \
+        int id_ = __atomic_load_n(&instr_id_, __ATOMIC_ACQUIRE);         \
+        if (id_ < 0)                                                     \
+        {                                                                \
+            id_ = instr_register(name, kind);                            \
+            __atomic_store_n(&instr_id_, id_, __ATOMIC_RELEASE);         \
+        }                                                                \
+        id_;                                                             \
+    }))
+#define INSTR_CAT_(a, b) a##b
+#define INSTR_CAT(a, b) INSTR_CAT_(a, b)
+
+#define INSTR_COUNT(name, n) instr_add(INSTR_ID(name, INSTR_KIND_COUNTER), (n))
+#define INSTR_VALUE(name, v) instr_record(INSTR_ID(name, INSTR_KIND_VALUE), (v))
+#define INSTR_TIMER_START(var) uint64_t var = instr_ticks()
+#define INSTR_TIMER_STOP(name, var) instr_stop(INSTR_ID(name, INSTR_KIND_TIMER), (var))
+#define INSTR_SCOPE(name)                                                                              \
+    instr_scope_t INSTR_CAT(instr_scope_, __LINE__) __attribute__((cleanup(instr_scope_end))) = {      \
+        instr_ticks(), INSTR_ID(name, INSTR_KIND_TIMER)}
+#define INSTR_TICK() instr_tick()
+
+#else
+
+#define INSTR_COUNT(name, n) ((void)0)
+#define INSTR_VALUE(name, v) ((void)0)
+#define INSTR_TIMER_START(var)
+#define INSTR_TIMER_STOP(name, var) ((void)0)
+#define INSTR_SCOPE(name)
+#define INSTR_TICK() ((void)0)
+
+#endif
+
+#endif
@@ -1,146 +1,743 @@
 #define _POSIX_C_SOURCE 200809L
 #include <errno.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../Instrumentation/sop-instr.h"
+
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 #define UNUSED(x) ((void)(x))
 
 #define DECK_SIZE (4 * 13)
 #define HAND_SIZE (7)
+#define SUITS 4
 #define MAX_PLAYERS 7
 #define MIN_PLAYERS 4
+#define SUIT_BITS 3 // Width of one packed suit count, enough for HAND_SIZE
+#define COUNT_STATES (1 << (SUITS * SUIT_BITS))
+#define SUIT_MASK 0x1111111111111ULL // Cards 0, 4, ..., 48: every card of suit 0
+#define BENCH_DEFAULT_GAMES 100000
+#define ANY_CARD_ODDS 8 // One pass in this many gives away any card, also one of the collected suit
+#define MAX_THREADS 64
+#define GAME_CHUNK 256 // Games a Monte Carlo worker claims at once
+#define HISTOGRAM_SIZE 256 // Game lengths in rounds, the last bucket also counts longer games
+
+// Hand as a bitmask over the deck, with the number of cards of each suit packed in SUIT_BITS wide fields
+typedef struct
+{
+    uint64_t cards;
+    uint16_t suit_counts;
+} hand_t;
 
 // Structure representing a player
 typedef struct
 {
-    int hand[HAND_SIZE]; // Player's hand
-    int id; // Player ID
-    pthread_t thread; // Thread assigned to the player
+    hand_t hand; // Player's hand
+    int id; // Player ID, also the seat at the table
+    pthread_t thread; // Thread assigned to the player, spawned before anyone joins
+    uint64_t rng; // Per-player generator state
+    int won; // Set in the check phase of a round when the hand is a single suit
+    pthread_mutex_t park_mutex; // The thread is parked on park_cond until its seat is taken
+    pthread_cond_t park_cond;
+    int seated;
+    struct timespec joined; // When the signal thread received the join of this seat
 } player_t;
 
 pthread_mutex_t game_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for synchronizing game state
 pthread_cond_t game_start = PTHREAD_COND_INITIALIZER; // Condition variable for starting the game
+pthread_cond_t table_changed = PTHREAD_COND_INITIALIZER; // Wakes the dealer when the table fills or empties
 player_t players[MAX_PLAYERS]; // Array of players
-int player_count = 0; // Current number of players
-int game_running = 1; // Flag indicating if the game is running
-sem_t game_sem; // Semaphore for controlling turns
+int seats_taken = 0; // Seats claimed by joins, updated atomically by the signal thread and reset by the dealer
+int player_count = 0; // Seated players that have woken up
+int finished_count = 0; // Players done with the running game
+int table_size; // Number of players a game is played with
+int game_started = 0; // Set by the dealer once every seated player has been dealt a hand
+int game_running = 1; // Flag indicating if the game is running, cleared by the signal thread on SIGINT
+
+// Join-to-seated latency of the running game: from sigwaitinfo returning in the signal thread to the parked
+// player thread running again
+long long join_latency_total_ns, join_latency_max_ns;
+long joins_rejected;
+
+// Round engine state; every round is two phases separated by the barrier:
+// check (each player tests its hand, then all read the verdict) and pass (each player puts a card into the
+// slot of its right neighbour, then takes the card from its own slot)
+pthread_barrier_t round_barrier;
+int slots[MAX_PLAYERS]; // Card passed to each seat in the running round
+int stop_requested; // Copy of game_running taken by seat 0, so all players stop in the same round
+long rounds; // Completed rounds of the running game
+
+// Lookup tables indexed by the packed suit counts of a hand
+uint8_t winning[COUNT_STATES]; // All cards share one suit
+uint8_t kept_suit[COUNT_STATES]; // Suit the player collects: the one it holds most of
+
+uint64_t dealer_rng; // Generator of the dealer, seeds the players of every game
+
+// Monte Carlo worker, one per thread of the pool; it only ever touches its own histogram
+typedef struct
+{
+    pthread_t thread;
+    uint64_t rng;
+    long games;
+    long rounds;
+    long histogram[HISTOGRAM_SIZE];
+    struct mc_batch *batch;
+} __attribute__((aligned(64))) mc_worker_t;
+
+// Monte Carlo batch shared by the pool, games are claimed GAME_CHUNK at a time
+typedef struct mc_batch
+{
+    int table_size;
+    long games;
+    long next;
+} mc_batch_t;
+
+// Function to scramble a 64-bit value (splitmix64 finalizer)
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9ULL;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EBULL;
+    return x ^ (x >> 31);
+}
+
+// Function to advance a xorshift64* generator; every thread owns its state, so nothing is shared
+uint64_t rng_next(uint64_t *state)
+{
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+// Function to draw a number below bound with a multiply-shift instead of a division
+uint32_t rng_below(uint64_t *state, uint32_t bound)
+{
+    return ((rng_next(state) >> 32) * bound) >> 32;
+}
+
+// Function to shuffle an array of at most DECK_SIZE elements (used for shuffling the deck). All swap
+// positions are drawn first from a counter-based generator, so the draws are independent and the loop
+// vectorizes; only the swaps themselves stay sequential
+void shuffle(int *array, size_t n, uint64_t *rng)
+{
+    uint32_t position[DECK_SIZE];
+    uint64_t key = rng_next(rng);
+    for (size_t i = 0; i < n; i++)
+        position[i] = i + (uint32_t)(((mix64(key + i * 0x9E3779B97F4A7C15ULL) >> 32) * (n - i)) >> 32);
+    for (size_t i = 0; i + 1 < n; i++)
+    {
+        int t = array[position[i]];
+        array[position[i]] = array[i];
+        array[i] = t;
+    }
+}
+
+// Function to shuffle the deck until the cards dealt to n players hold at least HAND_SIZE cards of one
+// suit; with fewer players most of the deck stays undealt and a game could otherwise never be won
+void shuffle_playable(int *deck, int n, uint64_t *rng)
+{
+    for (;;)
+    {
+        int count[SUITS] = {0};
+        shuffle(deck, DECK_SIZE, rng);
+        for (int i = 0; i < n * HAND_SIZE; i++)
+            if (++count[deck[i] % SUITS] == HAND_SIZE)
+                return;
+    }
+}
+
+// Function to print a player's hand
+void print_hand(hand_t *hand)
+{
+    for (uint64_t cards = hand->cards; cards != 0; cards &= cards - 1)
+    {
+        printf("%d ", __builtin_ctzll(cards));
+    }
+    printf("\n");
+}
 
-// Function to shuffle an array (used for shuffling the deck)
-void shuffle(int *array, size_t n)
+// Function to fill the lookup tables for every combination of suit counts
+void init_tables(void)
 {
-    if (n > 1)
+    for (int state = 0; state < COUNT_STATES; state++)
     {
-        for (size_t i = 0; i < n - 1; i++)
+        int most = -1;
+        for (int suit = 0; suit < SUITS; suit++)
         {
-            size_t j = i + rand() / (RAND_MAX / (n - i) + 1);
-            int t = array[j];
-            array[j] = array[i];
-            array[i] = t;
+            int count = (state >> (suit * SUIT_BITS)) & ((1 << SUIT_BITS) - 1);
+            if (count == HAND_SIZE)
+                winning[state] = 1;
+            if (count > most)
+            {
+                most = count;
+                kept_suit[state] = suit;
+            }
         }
     }
 }
 
-// Function to print a player's hand
-void print_hand(int *hand)
+// Function to add a card to a hand
+void hand_add(hand_t *hand, int card)
 {
+    hand->cards |= 1ULL << card;
+    hand->suit_counts += 1 << ((card % SUITS) * SUIT_BITS);
+}
+
+// Function to take a card out of a hand
+void hand_remove(hand_t *hand, int card)
+{
+    hand->cards &= ~(1ULL << card);
+    hand->suit_counts -= 1 << ((card % SUITS) * SUIT_BITS);
+}
+
+// Function to build a hand from dealt cards
+void hand_from_array(hand_t *hand, int *cards)
+{
+    hand->cards = 0;
+    hand->suit_counts = 0;
+    for (int i = 0; i < HAND_SIZE; i++)
+        hand_add(hand, cards[i]);
+}
+
+// Function to choose the card to pass: usually a random card outside the suit the player collects. Now
+// and then any card goes, so two players collecting the same suit cannot block each other forever
+int hand_choose_card(hand_t *hand, uint64_t *rng)
+{
+    uint64_t candidates = hand->cards;
+    if (rng_below(rng, ANY_CARD_ODDS) != 0)
+        candidates &= ~(SUIT_MASK << kept_suit[hand->suit_counts]);
+    for (int skip = rng_below(rng, __builtin_popcountll(candidates)); skip > 0; skip--)
+        candidates &= candidates - 1;
+    return __builtin_ctzll(candidates);
+}
+
+// Function to check whether all cards of an array hand share a suit; the array representation is kept
+// as the baseline of the benchmark
+int array_is_winning(int *hand)
+{
+    for (int i = 1; i < HAND_SIZE; i++)
+        if (hand[i] % SUITS != hand[0] % SUITS)
+            return 0;
+    return 1;
+}
+
+// Function to choose the card to pass from an array hand, with the same strategy as hand_choose_card
+int array_choose_card(int *hand, uint64_t *rng)
+{
+    if (rng_below(rng, ANY_CARD_ODDS) == 0)
+        return rng_below(rng, HAND_SIZE);
+    int count[SUITS] = {0}, kept = 0;
+    for (int i = 0; i < HAND_SIZE; i++)
+        count[hand[i] % SUITS]++;
+    for (int suit = 1; suit < SUITS; suit++)
+        if (count[suit] > count[kept])
+            kept = suit;
+    int skip = rng_below(rng, HAND_SIZE - count[kept]);
     for (int i = 0; i < HAND_SIZE; i++)
+        if (hand[i] % SUITS != kept && skip-- == 0)
+            return i;
+    return -1;
+}
+
+// Function to play games at one table on a single thread with array hands, returns the number of rounds
+long play_array_games(int n, int games, uint64_t deal_rng)
+{
+    int deck[DECK_SIZE], hands[MAX_PLAYERS][HAND_SIZE], chosen[MAX_PLAYERS], passed[MAX_PLAYERS];
+    uint64_t rng = mix64(deal_rng);
+    long total = 0;
+    for (int i = 0; i < DECK_SIZE; i++)
+        deck[i] = i;
+    for (int game = 0; game < games; game++)
     {
-        printf("%d ", hand[i]);
+        shuffle_playable(deck, n, &deal_rng);
+        memcpy(hands, deck, sizeof(int) * n * HAND_SIZE);
+        for (;;)
+        {
+            int over = 0;
+            for (int p = 0; p < n; p++)
+                over |= array_is_winning(hands[p]);
+            if (over)
+                break;
+            for (int p = 0; p < n; p++)
+            {
+                chosen[p] = array_choose_card(hands[p], &rng);
+                passed[(p + 1) % n] = hands[p][chosen[p]];
+            }
+            for (int p = 0; p < n; p++)
+                hands[p][chosen[p]] = passed[p];
+            total++;
+        }
     }
-    printf("\n");
+    return total;
 }
 
-// Thread function for a player
-void *player_thread(void *arg)
+// Function to deal and play one game at a table with bitmask hands, returns its length in rounds; deals
+// and passes may draw from separate generators, so the benchmark can replay the same deals
+long play_bitmask_game(int n, int *deck, uint64_t *deal_rng, uint64_t *rng)
 {
-    player_t *player = (player_t *)arg;
-    pthread_mutex_lock(&game_mutex);
-    while (player_count < MIN_PLAYERS)
+    int passed[MAX_PLAYERS];
+    hand_t hands[MAX_PLAYERS];
+    long rounds = 0;
+    shuffle_playable(deck, n, deal_rng);
+    for (int p = 0; p < n; p++)
+        hand_from_array(&hands[p], deck + p * HAND_SIZE);
+    for (;;)
     {
-        pthread_cond_wait(&game_start, &game_mutex); // Wait for enough players to join
+        int over = 0;
+        for (int p = 0; p < n; p++)
+            over |= winning[hands[p].suit_counts];
+        if (over)
+            return rounds;
+        for (int p = 0; p < n; p++)
+        {
+            int card = hand_choose_card(&hands[p], rng);
+            hand_remove(&hands[p], card);
+            passed[(p + 1) % n] = card;
+        }
+        for (int p = 0; p < n; p++)
+            hand_add(&hands[p], passed[p]);
+        rounds++;
     }
-    pthread_mutex_unlock(&game_mutex);
+}
 
-    printf("Player %d joined with hand: ", player->id);
-    print_hand(player->hand);
-    
-    // Simulation of the game (card exchange) - to be expanded
-    while (game_running)
+// Function to play games at one table on a single thread with bitmask hands, returns the number of rounds
+long play_bitmask_games(int n, int games, uint64_t deal_rng)
+{
+    int deck[DECK_SIZE];
+    uint64_t rng = mix64(deal_rng);
+    long total = 0;
+    for (int i = 0; i < DECK_SIZE; i++)
+        deck[i] = i;
+    for (int game = 0; game < games; game++)
+        total += play_bitmask_game(n, deck, &deal_rng, &rng);
+    return total;
+}
+
+// Function to compare the round speed of both hand representations on the same deals
+void benchmark(int n, int games)
+{
+    const char *names[2] = {"array", "bitmask"};
+    long (*play[2])(int, int, uint64_t) = {play_array_games, play_bitmask_games};
+    uint64_t seed = mix64(time(NULL));
+    double rate[2];
+    for (int i = 0; i < 2; i++)
     {
-        sem_wait(&game_sem); // Synchronize turns using semaphore
-        sleep(1); // Simulate turn duration
-        sem_post(&game_sem);
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long total = play[i](n, games, seed);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        rate[i] = total / seconds;
+        printf("%-8s %d games, %ld rounds in %.3f s: %.0f rounds/s (%.2f rounds/game)\n", names[i], games, total,
+               seconds, rate[i], (double)total / games);
     }
+    printf("bitmask speedup: %.2fx\n", rate[1] / rate[0]);
+}
 
+// Thread function of a Monte Carlo worker: it claims chunks of games and plays each at its own table, so
+// the workers share nothing but the chunk counter
+void *mc_worker(void *arg)
+{
+    mc_worker_t *worker = (mc_worker_t *)arg;
+    mc_batch_t *batch = worker->batch;
+    int deck[DECK_SIZE];
+    for (int i = 0; i < DECK_SIZE; i++)
+        deck[i] = i;
+    long first;
+    while ((first = __atomic_fetch_add(&batch->next, GAME_CHUNK, __ATOMIC_RELAXED)) < batch->games)
+    {
+        INSTR_SCOPE("mss_mc_chunk");
+        long last = first + GAME_CHUNK < batch->games ? first + GAME_CHUNK : batch->games;
+        for (long game = first; game < last; game++)
+        {
+            long length = play_bitmask_game(batch->table_size, deck, &worker->rng, &worker->rng);
+            worker->histogram[length < HISTOGRAM_SIZE - 1 ? length : HISTOGRAM_SIZE - 1]++;
+            worker->rounds += length;
+            worker->games++;
+        }
+        INSTR_COUNT("mss_mc_games", last - first);
+        INSTR_TICK();
+    }
     return NULL;
 }
 
-// Signal handler for SIGUSR1 - adds a new player
-void sigusr1_handler(int sig)
+// Function to find the game length below which the given fraction of games ended
+int histogram_percentile(long *histogram, long games, double fraction)
 {
-    UNUSED(sig);
-    pthread_mutex_lock(&game_mutex);
-    if (player_count < MAX_PLAYERS)
+    long seen = 0;
+    for (int length = 0; length < HISTOGRAM_SIZE; length++)
+    {
+        seen += histogram[length];
+        if (seen >= fraction * games)
+            return length;
+    }
+    return HISTOGRAM_SIZE - 1;
+}
+
+// Function to play a batch of independent games on a pool of threads and report game-length statistics
+void monte_carlo(int n, long games, int thread_count)
+{
+    mc_batch_t batch = {n, games, 0};
+    mc_worker_t *workers;
+    if ((errno = posix_memalign((void **)&workers, 64, sizeof(mc_worker_t) * thread_count)) != 0)
+        ERR("posix_memalign");
+    memset(workers, 0, sizeof(mc_worker_t) * thread_count);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < thread_count; i++)
+    {
+        workers[i].batch = &batch;
+        workers[i].rng = mix64(rng_next(&dealer_rng));
+        if ((errno = pthread_create(&workers[i].thread, NULL, mc_worker, &workers[i])) != 0)
+            ERR("pthread_create");
+    }
+    long histogram[HISTOGRAM_SIZE] = {0}, rounds = 0;
+    for (int i = 0; i < thread_count; i++)
+    {
+        if ((errno = pthread_join(workers[i].thread, NULL)) != 0)
+            ERR("pthread_join");
+        for (int length = 0; length < HISTOGRAM_SIZE; length++)
+            histogram[length] += workers[i].histogram[length];
+        rounds += workers[i].rounds;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    printf("%ld games with %d players on %d threads in %.3f s: %.0f games/s, %.0f rounds/s\n", games, n,
+           thread_count, seconds, games / seconds, rounds / seconds);
+    printf("Game length in rounds: mean %.2f, p50 %d, p90 %d, p99 %d, p99.9 %d\n", (double)rounds / games,
+           histogram_percentile(histogram, games, 0.5), histogram_percentile(histogram, games, 0.9),
+           histogram_percentile(histogram, games, 0.99), histogram_percentile(histogram, games, 0.999));
+    long peak = 1;
+    for (int length = 0; length < HISTOGRAM_SIZE; length++)
+        if (histogram[length] > peak)
+            peak = histogram[length];
+    int last = histogram_percentile(histogram, games, 0.99);
+    for (int length = 0; length <= last; length++)
+    {
+        printf("%4d %10ld ", length, histogram[length]);
+        for (int i = 0; i < 50 * histogram[length] / peak; i++)
+            putchar('#');
+        putchar('\n');
+    }
+    long longer = 0;
+    for (int length = last + 1; length < HISTOGRAM_SIZE; length++)
+        longer += histogram[length];
+    printf(">%3d %10ld\n", last, longer);
+    free(workers);
+}
+
+// Function to wait on the round barrier
+void round_wait(void)
+{
+    int status = pthread_barrier_wait(&round_barrier);
+    if (status != 0 && status != PTHREAD_BARRIER_SERIAL_THREAD)
+    {
+        errno = status;
+        ERR("pthread_barrier_wait");
+    }
+}
+
+// Function to record the latency of a join once its player thread runs
+void record_join_latency(player_t *player)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long latency = (now.tv_sec - player->joined.tv_sec) * 1000000000LL + (now.tv_nsec - player->joined.tv_nsec);
+    __atomic_add_fetch(&join_latency_total_ns, latency, __ATOMIC_RELAXED);
+    INSTR_VALUE("mss_join_latency_ns", latency);
+    long long max = __atomic_load_n(&join_latency_max_ns, __ATOMIC_RELAXED);
+    while (latency > max &&
+           !__atomic_compare_exchange_n(&join_latency_max_ns, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+// Function to play the rounds of one game at the seat of a player
+void play(player_t *player)
+{
+    int right = (player->id + 1) % table_size;
+    for (;;)
     {
-        players[player_count].id = player_count + 1;
-        pthread_create(&players[player_count].thread, NULL, player_thread, &players[player_count]);
-        player_count++;
-        if (player_count >= MIN_PLAYERS)
+        INSTR_TIMER_START(round_start);
+        // Check phase
+        player->won = winning[player->hand.suit_counts];
+        if (player->id == 0)
+            stop_requested = !__atomic_load_n(&game_running, __ATOMIC_RELAXED);
+        round_wait();
+        int over = stop_requested;
+        for (int i = 0; i < table_size; i++)
+            over |= players[i].won;
+        if (over)
+            break;
+
+        // Pass phase
+        int card = hand_choose_card(&player->hand, &player->rng);
+        hand_remove(&player->hand, card);
+        slots[right] = card;
+        round_wait();
+        hand_add(&player->hand, slots[player->id]);
+        if (player->id == 0)
         {
-            pthread_cond_broadcast(&game_start); // Start game when enough players join
+            rounds++;
+            INSTR_TIMER_STOP("mss_round", round_start);
         }
     }
-    else
+
+    if (player->won)
+    {
+        printf("Player %d: My ship sails! ", player->id);
+        print_hand(&player->hand);
+    }
+}
+
+// Thread function for a player; the thread exists before anyone joins and plays one game per join
+void *player_thread(void *arg)
+{
+    player_t *player = (player_t *)arg;
+    for (;;)
     {
-        printf("No more seats available.\n");
+        // Parked until the signal thread hands this seat to a joining player
+        pthread_mutex_lock(&player->park_mutex);
+        while (!player->seated && __atomic_load_n(&game_running, __ATOMIC_RELAXED))
+            pthread_cond_wait(&player->park_cond, &player->park_mutex);
+        int seated = player->seated;
+        pthread_mutex_unlock(&player->park_mutex);
+        if (!seated)
+            return NULL;
+        record_join_latency(player);
+
+        pthread_mutex_lock(&game_mutex);
+        if (++player_count == table_size)
+            pthread_cond_signal(&table_changed);
+        while (!game_started && game_running)
+        {
+            pthread_cond_wait(&game_start, &game_mutex); // Wait for the dealer to deal the hands
+        }
+        int playing = game_started;
+        pthread_mutex_unlock(&game_mutex);
+        if (!playing)
+            return NULL;
+
+        printf("Player %d joined with hand: ", player->id);
+        print_hand(&player->hand);
+        play(player);
+
+        // The seat is given up before the dealer can reopen the table
+        pthread_mutex_lock(&player->park_mutex);
+        player->seated = 0;
+        pthread_mutex_unlock(&player->park_mutex);
+        pthread_mutex_lock(&game_mutex);
+        if (++finished_count == table_size)
+            pthread_cond_signal(&table_changed);
+        pthread_mutex_unlock(&game_mutex);
     }
+}
+
+// Function to claim a free seat, returns -1 when the table is full
+int claim_seat(void)
+{
+    int taken = __atomic_load_n(&seats_taken, __ATOMIC_RELAXED);
+    do
+    {
+        if (taken >= table_size)
+            return -1;
+    } while (!__atomic_compare_exchange_n(&seats_taken, &taken, taken + 1, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+    return taken;
+}
+
+// Function to stop the game and wake every thread that waits for something that will not come
+void stop_game(void)
+{
+    pthread_mutex_lock(&game_mutex);
+    __atomic_store_n(&game_running, 0, __ATOMIC_RELAXED);
+    pthread_cond_broadcast(&game_start);
+    pthread_cond_broadcast(&table_changed);
     pthread_mutex_unlock(&game_mutex);
+    for (int i = 0; i < table_size; i++)
+    {
+        pthread_mutex_lock(&players[i].park_mutex);
+        pthread_cond_signal(&players[i].park_cond);
+        pthread_mutex_unlock(&players[i].park_mutex);
+    }
+}
+
+// Thread function consuming all signals; signals are blocked in every other thread, so nothing runs in
+// signal context. SIGUSR1 joins a player (pending SIGUSR1s coalesce, SIGRTMIN joins are queued one by one)
+// and SIGINT terminates the game
+void *signal_thread(void *arg)
+{
+    sigset_t *mask = (sigset_t *)arg;
+    siginfo_t info;
+    for (;;)
+    {
+        if (sigwaitinfo(mask, &info) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("sigwaitinfo");
+        }
+        if (info.si_signo == SIGINT)
+        {
+            stop_game();
+            return NULL;
+        }
+        struct timespec joined;
+        clock_gettime(CLOCK_MONOTONIC, &joined);
+        int seat = claim_seat();
+        if (seat == -1)
+        {
+            __atomic_add_fetch(&joins_rejected, 1, __ATOMIC_RELAXED);
+            INSTR_COUNT("mss_joins_rejected", 1);
+            continue;
+        }
+        player_t *player = &players[seat];
+        pthread_mutex_lock(&player->park_mutex);
+        player->joined = joined;
+        player->seated = 1;
+        pthread_cond_signal(&player->park_cond);
+        pthread_mutex_unlock(&player->park_mutex);
+        INSTR_COUNT("mss_joins", 1);
+    }
 }
 
-// Signal handler for SIGINT - terminates the game
-void sigint_handler(int sig)
+// Function to deal the shuffled deck to the seated players and start the round engine, game_mutex is held
+void deal(int *deck)
 {
-    UNUSED(sig);
-    game_running = 0; // Set flag to stop game
-    for (int i = 0; i < player_count; i++)
+    shuffle_playable(deck, table_size, &dealer_rng);
+    if ((errno = pthread_barrier_init(&round_barrier, NULL, table_size)) != 0)
+        ERR("pthread_barrier_init");
+    rounds = 0;
+    for (int i = 0; i < table_size; i++)
     {
-        pthread_join(players[i].thread, NULL); // Wait for all player threads to terminate
+        hand_from_array(&players[i].hand, deck + i * HAND_SIZE);
+        players[i].rng = mix64(rng_next(&dealer_rng));
+        players[i].won = 0;
     }
-    sem_destroy(&game_sem); // Destroy semaphore
-    exit(EXIT_SUCCESS);
+    game_started = 1;
+    pthread_cond_broadcast(&game_start);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc != 2)
+    int bench = argc >= 3 && strcmp(argv[1], "-b") == 0;
+    int batch = argc >= 4 && strcmp(argv[1], "-m") == 0;
+    if (argc != 2 && !(bench && argc <= 4) && !(batch && argc <= 5))
     {
         fprintf(stderr, "USAGE: %s n\n", argv[0]);
+        fprintf(stderr, "       %s -b n [games]\n", argv[0]);
+        fprintf(stderr, "       %s -m n games [threads]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
-    int n = atoi(argv[1]);
+    int n = atoi(argv[bench || batch ? 2 : 1]);
     if (n < MIN_PLAYERS || n > MAX_PLAYERS)
     {
         fprintf(stderr, "Number of players must be between %d and %d.\n", MIN_PLAYERS, MAX_PLAYERS);
         exit(EXIT_FAILURE);
     }
+    table_size = n;
+    init_tables();
+    dealer_rng = mix64(time(NULL) ^ ((uint64_t)getpid() << 32));
+    if (bench)
+    {
+        benchmark(n, argc == 4 ? atoi(argv[3]) : BENCH_DEFAULT_GAMES);
+        return EXIT_SUCCESS;
+    }
+    if (batch)
+    {
+        long games = atol(argv[3]);
+        int thread_count = argc == 5 ? atoi(argv[4]) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (games < 1 || thread_count < 1 || thread_count > MAX_THREADS)
+        {
+            fprintf(stderr, "Games must be positive and threads between 1 and %d.\n", MAX_THREADS);
+            exit(EXIT_FAILURE);
+        }
+        monte_carlo(n, games, thread_count);
+        return EXIT_SUCCESS;
+    }
+
+    int deck[DECK_SIZE];
+    for (int i = 0; i < DECK_SIZE; i++)
+        deck[i] = i;
 
-    srand(time(NULL));
-    signal(SIGUSR1, sigusr1_handler); // Register SIGUSR1 handler for adding players
-    signal(SIGINT, sigint_handler); // Register SIGINT handler for termination
-    sem_init(&game_sem, 0, 1); // Initialize semaphore
+    // Blocked before any thread exists, so every thread inherits the mask and only the signal thread takes them
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGRTMIN);
+    sigaddset(&mask, SIGINT);
+    if ((errno = pthread_sigmask(SIG_BLOCK, &mask, NULL)) != 0)
+        ERR("pthread_sigmask");
+    for (int i = 0; i < table_size; i++)
+    {
+        players[i].id = i;
+        if ((errno = pthread_mutex_init(&players[i].park_mutex, NULL)) != 0 ||
+            (errno = pthread_cond_init(&players[i].park_cond, NULL)) != 0)
+            ERR("pthread_cond_init");
+        if ((errno = pthread_create(&players[i].thread, NULL, player_thread, &players[i])) != 0)
+            ERR("pthread_create");
+    }
+    pthread_t signal_tid;
+    if ((errno = pthread_create(&signal_tid, NULL, signal_thread, &mask)) != 0)
+        ERR("pthread_create");
 
     printf("Game is ready. Send SIGUSR1 to add players.\n");
+    pthread_mutex_lock(&game_mutex);
     while (game_running)
     {
-        pause(); // Wait for signals
+        while (player_count < table_size && game_running)
+        {
+            pthread_cond_wait(&table_changed, &game_mutex); // Wait for the table to fill
+        }
+        if (!game_running)
+            break;
+
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        deal(deck);
+        while (finished_count < table_size)
+        {
+            pthread_cond_wait(&table_changed, &game_mutex);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+        printf("Game over after %ld rounds in %.3f ms (%.0f rounds/s)\n", rounds, seconds * 1e3,
+               seconds > 0 ? rounds / seconds : 0.0);
+        printf("Join-to-seated latency: avg %.1f us, max %.1f us; %ld joins turned away\n",
+               __atomic_load_n(&join_latency_total_ns, __ATOMIC_RELAXED) / 1e3 / table_size,
+               __atomic_load_n(&join_latency_max_ns, __ATOMIC_RELAXED) / 1e3,
+               __atomic_exchange_n(&joins_rejected, 0, __ATOMIC_RELAXED));
+        INSTR_COUNT("mss_games", 1);
+        INSTR_TICK();
+        pthread_barrier_destroy(&round_barrier);
+        player_count = 0;
+        finished_count = 0;
+        game_started = 0;
+        __atomic_store_n(&join_latency_total_ns, 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&join_latency_max_ns, 0, __ATOMIC_RELAXED);
+        // Reopening the table: joins from now on claim seats of the next game
+        __atomic_store_n(&seats_taken, 0, __ATOMIC_RELEASE);
+        if (game_running)
+            printf("Send SIGUSR1 to add players for the next game.\n");
+    }
+    pthread_mutex_unlock(&game_mutex);
+
+    // Players still waiting for a seat or a full table are released without playing
+    for (int i = 0; i < table_size; i++)
+    {
+        pthread_join(players[i].thread, NULL);
+        pthread_cond_destroy(&players[i].park_cond);
+        pthread_mutex_destroy(&players[i].park_mutex);
     }
+    pthread_join(signal_tid, NULL);
     return EXIT_SUCCESS;
 }
@@ -1,153 +1,1589 @@
-#define _XOPEN_SOURCE 500
+#define _GNU_SOURCE
 
 #include <dirent.h>
 #include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <linux/fs.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
-#include <errno.h>
+#include <inttypes.h>
 #include <time.h>
 
+#include "../Instrumentation/sop-instr.h"
+
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE))
 #define MAX_BUFFER_SIZE 500
 #define REQUIREMENTS_FILE "requirements"
+#define REQUIREMENTS_TMP_FILE "requirements.tmp"
+#define INITIAL_BUCKETS 64
+#define MAX_THREADS 64
+#define STORE_KEY_SIZE 256
+#define STALE_TMP_SECONDS 60
+#define MAX_OPTIMISTIC_ATTEMPTS 3
+#define SNAPSHOT_MAGIC "SOPVSNP1"
+
+// Single requirements entry, linked both into a hash chain and into the file order list
+typedef struct package
+{
+    char* name;
+    char* version;
+    char* depends;         // Comma separated names of required packages, NULL if there are none
+    char* staged;          // Name the file is written under when it replaces a removed version, else NULL
+    struct package* chain; // Next entry in the same hash bucket
+    struct package* prev;  // Neighbours in file order
+    struct package* next;
+    int fresh;   // Installed by the running transaction, its file does not exist yet
+    int written; // Package file created by the running transaction
+    int wave;    // Install wave of a fresh package, its dependencies are written in earlier waves
+} package_t;
 
-// Function to change the current working directory and return the previous directory
-char* change_directory(char *dir)
+// Requirements file of one environment, indexed by package name
+typedef struct
 {
-    char* previous_directory = (char*)malloc(MAX_BUFFER_SIZE);
-    if (getcwd(previous_directory, MAX_BUFFER_SIZE) == NULL)
-        ERR("getcwd");
-    if (chdir(dir))
-        ERR("chdir");
-    return previous_directory;
+    package_t** buckets;
+    size_t bucket_count;
+    size_t count;
+    package_t* head;
+    package_t* tail;
+    int dirty; // Set when the index differs from the file
+    struct stat loaded; // Identity of the file the index was loaded from
+} requirements_t;
+
+// Operation given on the command line, applied in order to every environment
+typedef struct
+{
+    char kind; // 'i' install, 'r' remove
+    char* argument;
+} operation_t;
+
+// Package removed by a transaction, its version names the store entry it may have been linked from
+typedef struct
+{
+    char* name;
+    char* version;
+    int replaced; // Installed again by the same transaction, the staged file is renamed over it
+} removed_t;
+
+// Package files to delete once the new requirements are committed
+typedef struct
+{
+    removed_t* removed;
+    int removed_count;
+} transaction_t;
+
+// Environment processed by one task of the thread pool
+typedef struct
+{
+    char* dir;
+    int dir_fd;          // All file operations are relative to this descriptor, never to the cwd
+    char payload[MAX_BUFFER_SIZE]; // Reusable buffer for generated package content
+    size_t payload_size;
+    long long lock_wait_ns; // Time spent blocked on the environment lock
+    int retries;            // Optimistic attempts that found requirements changed under them
+    int committed;          // The new requirements are in place, later failures cannot be rolled back
+    int failed;
+    char error[MAX_BUFFER_SIZE];
+} environment_t;
+
+// Work shared by the thread pool, environments are claimed through an atomic index
+typedef struct
+{
+    environment_t* environments;
+    int environment_count;
+    int next;
+    operation_t* operations;
+    int operation_count;
+} work_t;
+
+// Package installed by the run, a node of the dependency graph shared by all environments
+typedef struct
+{
+    char* name;
+    int* depends;    // Nodes this package requires
+    int depends_count;
+    int* dependents; // Nodes that require this package
+    int dependents_count;
+    int pending;     // Dependencies not yet placed in a wave
+    int wave;
+} plan_node_t;
+
+// Install order of the run, resolved once and reused by every environment
+typedef struct
+{
+    plan_node_t* nodes; // Sorted by name
+    int count;
+    int waves;
+} install_plan_t;
+
+// Wave of package files written by several threads into one environment
+typedef struct
+{
+    environment_t* environment;
+    package_t** packages;
+    int count;
+    int next;
+    pthread_mutex_t mutex; // Guards the error of the environment
+} wave_t;
+
+// Package of a sync source or a snapshot
+typedef struct
+{
+    char* name;
+    char* version;
+    char* depends; // NULL if there are none
+} entry_t;
+
+// Desired contents of an environment, sorted by name
+typedef struct
+{
+    entry_t* entries;
+    int count;
+} package_set_t;
+
+install_plan_t install_plan = {NULL, 0, 0};
+package_set_t sync_source = {NULL, 0};
+int syncing = 0; // Targets are made to match sync_source instead of applying operations
+int wave_threads = 1; // Threads writing one wave of an environment
+int store_fd = -1; // Content store shared by all environments, -1 when payloads are not deduplicated
+int report_locks = 0; // Print lock wait time and optimistic retries of every environment
 
+// Function to record an error of an environment, the description of errno is appended; returns -1
+int environment_error(environment_t* environment, const char* format, ...)
+{
+    int saved_errno = errno;
+    char message[MAX_BUFFER_SIZE / 2], buffer[64];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    const char* description = strerror_r(saved_errno, buffer, sizeof(buffer));
+    if (!environment->failed)
+        snprintf(environment->error, sizeof(environment->error), "%s: %s", message, description);
+    environment->failed = 1;
+    return -1;
 }
 
 // Function to create a new repository directory and initialize a requirements file
 void create_repository(char* dir)
 {
-    FILE* output;
-    if(mkdir(dir, 0755) == -1)
+    if(mkdirat(AT_FDCWD, dir, 0755) == -1)
     {
         if(errno == EEXIST)
             ERR("the directory already exists");
         ERR("mkdir");
         }
-    char* previous_directory = change_directory(dir);
-    if((output = fopen(REQUIREMENTS_FILE, "w")) == NULL) 
+    int dir_fd, output_fd;
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
         ERR("open");
-    fclose(output);
-    chdir(previous_directory);
+    if((output_fd = openat(dir_fd, REQUIREMENTS_FILE, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        ERR("open");
+    close(output_fd);
+    close(dir_fd);
+}
+
+// FNV-1a hash of a package name
+size_t hash_name(const char* name)
+{
+    size_t hash = 2166136261u;
+    for (; *name; name++)
+    {
+        hash ^= (unsigned char)*name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to find a package in the index, returns NULL if it is not installed
+package_t* requirements_find(requirements_t* requirements, const char* name)
+{
+    package_t* package = requirements->buckets[hash_name(name) & (requirements->bucket_count - 1)];
+    while (package != NULL && strcmp(package->name, name) != 0)
+        package = package->chain;
+    return package;
+}
+
+// Function to double the number of buckets once the load factor reaches 1
+void requirements_grow(requirements_t* requirements)
+{
+    size_t bucket_count = requirements->bucket_count * 2;
+    package_t** buckets = calloc(bucket_count, sizeof(package_t*));
+    if (buckets == NULL)
+        ERR("calloc");
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+    {
+        size_t bucket = hash_name(package->name) & (bucket_count - 1);
+        package->chain = buckets[bucket];
+        buckets[bucket] = package;
+    }
+    free(requirements->buckets);
+    requirements->buckets = buckets;
+    requirements->bucket_count = bucket_count;
+}
+
+// Function to append a package to the index, the caller checks for duplicates
+package_t* requirements_add(requirements_t* requirements, const char* name, const char* version, const char* depends)
+{
+    if (requirements->count >= requirements->bucket_count)
+        requirements_grow(requirements);
+
+    package_t* package = malloc(sizeof(package_t));
+    if (package == NULL || (package->name = strdup(name)) == NULL || (package->version = strdup(version)) == NULL)
+        ERR("malloc");
+    package->depends = NULL;
+    package->staged = NULL;
+    if (depends != NULL && depends[0] != '\0' && (package->depends = strdup(depends)) == NULL)
+        ERR("strdup");
+
+    size_t bucket = hash_name(name) & (requirements->bucket_count - 1);
+    package->chain = requirements->buckets[bucket];
+    requirements->buckets[bucket] = package;
+
+    package->prev = requirements->tail;
+    package->next = NULL;
+    package->fresh = 0;
+    package->written = 0;
+    package->wave = 0;
+    if (requirements->tail != NULL)
+        requirements->tail->next = package;
+    else
+        requirements->head = package;
+    requirements->tail = package;
+    requirements->count++;
+    requirements->dirty = 1;
+    return package;
 }
 
-// Function to check if a package is already listed in the requirements file
-int check_package_exists(char* buffer, char* package_name)
+// Function to unlink a package from the index and free it
+void requirements_remove(requirements_t* requirements, package_t* package)
 {
-    int name_length = strchr(buffer, ' ') - buffer;
-    char* extracted_name = (char*)malloc(name_length + 1);
-    strncpy(extracted_name, buffer, name_length);
-    extracted_name[name_length] = '\0';
-    if (strcmp(package_name, extracted_name) == 0) return 0;
-    return 1;
+    package_t** link = &requirements->buckets[hash_name(package->name) & (requirements->bucket_count - 1)];
+    while (*link != package)
+        link = &(*link)->chain;
+    *link = package->chain;
+
+    if (package->prev != NULL)
+        package->prev->next = package->next;
+    else
+        requirements->head = package->next;
+    if (package->next != NULL)
+        package->next->prev = package->prev;
+    else
+        requirements->tail = package->prev;
+
+    free(package->name);
+    free(package->version);
+    free(package->depends);
+    free(package->staged);
+    free(package);
+    requirements->count--;
+    requirements->dirty = 1;
 }
 
-// Function to add a new package entry to the requirements file
-void add_package_entry(char* package_name, char* package_version)
-{ 
+// Function to initialize an empty index
+void requirements_init(requirements_t* requirements)
+{
+    memset(requirements, 0, sizeof(requirements_t));
+    requirements->bucket_count = INITIAL_BUCKETS;
+    if ((requirements->buckets = calloc(requirements->bucket_count, sizeof(package_t*))) == NULL)
+        ERR("calloc");
+}
+
+// Function to load the requirements file of an environment into an index
+int requirements_load(environment_t* environment, requirements_t* requirements)
+{
+    requirements_init(requirements);
+
+    int fd;
+    FILE* requirements_file;
+    if ((fd = openat(environment->dir_fd, REQUIREMENTS_FILE, O_RDONLY)) == -1)
+        return environment_error(environment, "the environment does not exist");
+    if (fstat(fd, &requirements->loaded) == -1)
+        ERR("fstat");
+    if((requirements_file = fdopen(fd, "r")) == NULL)
+        ERR("fdopen");
+
+    char buffer[MAX_BUFFER_SIZE];
+    while(fgets(buffer, MAX_BUFFER_SIZE, requirements_file) != NULL)
+    {
+        char* version = strchr(buffer, ' ');
+        if (version == NULL)
+            continue;
+        *version++ = '\0';
+        version[strcspn(version, "\n")] = '\0';
+        char* depends = strchr(version, ' ');
+        if (depends != NULL)
+            *depends++ = '\0';
+        if (requirements_find(requirements, buffer) == NULL)
+            requirements_add(requirements, buffer, version, depends);
+    }
+    fclose(requirements_file);
+    requirements->dirty = 0;
+    return 0;
+}
+
+// Function to check whether requirements is still the file the index was loaded from; every commit renames
+// a new inode over it, so a concurrent commit always changes its identity
+int requirements_unchanged(environment_t* environment, requirements_t* requirements)
+{
+    struct stat st;
+    if (fstatat(environment->dir_fd, REQUIREMENTS_FILE, &st, 0) == -1)
+        return 0;
+    return st.st_ino == requirements->loaded.st_ino && st.st_size == requirements->loaded.st_size &&
+           st.st_mtim.tv_sec == requirements->loaded.st_mtim.tv_sec &&
+           st.st_mtim.tv_nsec == requirements->loaded.st_mtim.tv_nsec &&
+           st.st_ctim.tv_sec == requirements->loaded.st_ctim.tv_sec &&
+           st.st_ctim.tv_nsec == requirements->loaded.st_ctim.tv_nsec;
+}
+
+// Function to open the temporary file of a commit; an anonymous O_TMPFILE is used where the file system
+// supports it, otherwise a name unique to this process and thread is created exclusively
+int open_requirements_tmp(environment_t* environment, char* tmp_name, size_t size, int* anonymous)
+{
+    int fd;
+    snprintf(tmp_name, size, "%s.%d.%lx", REQUIREMENTS_TMP_FILE, getpid(), (unsigned long)pthread_self());
+    if ((fd = openat(environment->dir_fd, ".", O_TMPFILE | O_WRONLY, 0644)) != -1)
+    {
+        *anonymous = 1;
+        return fd;
+    }
+    *anonymous = 0;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if ((fd = openat(environment->dir_fd, tmp_name, O_WRONLY | O_CREAT | O_EXCL, 0644)) != -1 || errno != EEXIST)
+            return fd;
+        // Left by a crashed run that had the same pid, it was never renamed so nothing refers to it
+        unlinkat(environment->dir_fd, tmp_name, 0);
+    }
+    return -1;
+}
+
+// Function to write the index back through a temporary file renamed over requirements; this is the commit
+// point of a transaction and the only fsync it does
+int requirements_save(environment_t* environment, requirements_t* requirements)
+{
+    if (!requirements->dirty)
+        return 0;
+    int fd, anonymous;
     FILE* output;
-    if((output = fopen(REQUIREMENTS_FILE, "a")) == NULL) 
-        ERR("open");
-    fprintf(output, "%s %s\n", package_name, package_version);
+    char tmp_name[64], fd_path[64];
+    if ((fd = open_requirements_tmp(environment, tmp_name, sizeof(tmp_name), &anonymous)) == -1)
+        return environment_error(environment, "open %s", tmp_name);
+    if((output = fdopen(fd, "w")) == NULL)
+        ERR("fdopen");
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+        fprintf(output, "%s %s%s%s\n", package->name, package->version, package->depends ? " " : "",
+                package->depends ? package->depends : "");
+    if (fflush(output) == EOF || fsync(fd) == -1)
+    {
+        fclose(output);
+        if (!anonymous)
+            unlinkat(environment->dir_fd, tmp_name, 0);
+        return environment_error(environment, "write %s", tmp_name);
+    }
+    // The anonymous file gets its private name only now that it is complete
+    snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+    if (anonymous && linkat(AT_FDCWD, fd_path, environment->dir_fd, tmp_name, AT_SYMLINK_FOLLOW) == -1)
+    {
+        fclose(output);
+        return environment_error(environment, "link %s", tmp_name);
+    }
     fclose(output);
+    if (renameat(environment->dir_fd, tmp_name, environment->dir_fd, REQUIREMENTS_FILE) == -1)
+    {
+        int saved_errno = errno;
+        unlinkat(environment->dir_fd, tmp_name, 0);
+        errno = saved_errno;
+        return environment_error(environment, "rename %s", tmp_name);
+    }
+    requirements->dirty = 0;
+    return 0;
+}
+
+// Function to release the index
+void requirements_free(requirements_t* requirements)
+{
+    package_t* package = requirements->head;
+    while (package != NULL)
+    {
+        package_t* next = package->next;
+        free(package->name);
+        free(package->version);
+        free(package->depends);
+        free(package->staged);
+        free(package);
+        package = next;
+    }
+    free(requirements->buckets);
+}
+
+// Function to generate the content of a package; it is derived from name and version so that identical
+// package versions have identical payloads in every environment
+size_t generate_payload(const char* package_name, const char* package_version, char* buffer)
+{
+    unsigned int seed = hash_name(package_name) * 31 + hash_name(package_version);
+    size_t size = rand_r(&seed) % MAX_BUFFER_SIZE;
+    for (size_t i = 0; i < size; i++)
+        buffer[i] = rand_r(&seed) % 128;
+    return size;
+}
 
-    // Creating a new file for the package
+// Function for safe bulk writing to a file descriptor
+ssize_t bulk_write(int fd, const char* buf, size_t size)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    while (size > 0)
+    {
+        c = TEMP_FAILURE_RETRY(write(fd, buf, size));
+        if (c < 0)
+            return c;
+        buf += c;
+        len += c;
+        size -= c;
+    }
+    return len;
+}
+
+// Function to create a file in a directory and fill it with a payload, preallocated in one extent
+int write_payload_file(int dir_fd, const char* file_name, const char* payload, size_t size)
+{
     int output_fd;
-    if((output_fd = open(package_name, O_WRONLY | O_CREAT | O_TRUNC, 0444)) == -1) 
-        ERR("open");
-    for (int i = 0; i < rand() % MAX_BUFFER_SIZE; i++)
+    if ((output_fd = openat(dir_fd, file_name, O_WRONLY | O_CREAT | O_EXCL, 0444)) == -1)
+        return -1;
+    if ((size > 0 && (errno = posix_fallocate(output_fd, 0, size)) != 0 && errno != EOPNOTSUPP) ||
+        bulk_write(output_fd, payload, size) < 0)
     {
-        char *buf = malloc(sizeof(char));
-        buf[0] = rand() % 128;
-        write(output_fd, buf, 1);
-        free(buf);
+        int saved_errno = errno;
+        close(output_fd);
+        unlinkat(dir_fd, file_name, 0);
+        errno = saved_errno;
+        return -1;
     }
     close(output_fd);
+    return 0;
 }
 
-// Function to add a new package to a repository
-void add_new_package(char* input_str, char* repository_dir)
+// Function to copy a store file into an environment when it cannot be hard linked: reflink first, then
+// an in-kernel copy_file_range, then plain reads
+int clone_package_file(environment_t* environment, const char* key, const char* package_name)
 {
-    int name_length = strchr(input_str, '=') - input_str;
-    char* package_name = (char*)malloc(name_length + 1);
-    strncpy(package_name, input_str, name_length);
-    package_name[name_length] = '\0';
-    char* package_version = strrchr(input_str, '=') + 1; 
+    int input_fd, output_fd;
+    struct stat st;
+    if ((input_fd = openat(store_fd, key, O_RDONLY)) == -1)
+        return -1;
+    if (fstat(input_fd, &st) == -1 ||
+        (output_fd = openat(environment->dir_fd, package_name, O_WRONLY | O_CREAT | O_EXCL, 0444)) == -1)
+    {
+        close(input_fd);
+        return -1;
+    }
+    int status = 0;
+    if (ioctl(output_fd, FICLONE, input_fd) == -1)
+    {
+        off_t left = st.st_size;
+        while (left > 0)
+        {
+            ssize_t copied = copy_file_range(input_fd, NULL, output_fd, NULL, left, 0);
+            if (copied == -1 && (errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+            {
+                // Not supported between these file systems, copy through the payload buffer instead
+                copied = TEMP_FAILURE_RETRY(read(input_fd, environment->payload, sizeof(environment->payload)));
+                if (copied > 0 && bulk_write(output_fd, environment->payload, copied) < 0)
+                    copied = -1;
+            }
+            if (copied <= 0)
+            {
+                status = -1;
+                break;
+            }
+            left -= copied;
+        }
+    }
+    int saved_errno = errno;
+    close(input_fd);
+    close(output_fd);
+    if (status == -1)
+    {
+        unlinkat(environment->dir_fd, package_name, 0);
+        errno = saved_errno;
+    }
+    return status;
+}
 
-    char* previous_directory = change_directory(repository_dir);
-    FILE* requirements_file;
-    if((requirements_file = fopen(REQUIREMENTS_FILE, "r")) == NULL) 
-        ERR("open");
+// Function to generate the payload of a package into the environment buffer and name its store entry
+// "<NAME>==<VERSION>-<CONTENT HASH>"
+int store_key(environment_t* environment, const char* package_name, const char* package_version, char* key)
+{
+    environment->payload_size = generate_payload(package_name, package_version, environment->payload);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < environment->payload_size; i++)
+    {
+        hash ^= (unsigned char)environment->payload[i];
+        hash *= 1099511628211ull;
+    }
+    if (snprintf(key, STORE_KEY_SIZE, "%s==%s-%016" PRIx64, package_name, package_version, hash) >= STORE_KEY_SIZE)
+    {
+        errno = ENAMETOOLONG;
+        return environment_error(environment, "store key for %s", package_name);
+    }
+    return 0;
+}
 
-    char buffer[MAX_BUFFER_SIZE];
-    int exists = 0;
-    while(fgets(buffer, MAX_BUFFER_SIZE, requirements_file) != NULL)
+// Function to make sure the store holds the payload in the environment buffer under its key
+int store_payload(environment_t* environment, const char* key)
+{
+    // The payload is written under a private name and published with linkat, so concurrent installers
+    // never observe a partially written store file
+    char tmp_name[STORE_KEY_SIZE + 32];
+    snprintf(tmp_name, sizeof(tmp_name), ".%s.%d.%lx", key, getpid(), (unsigned long)pthread_self());
+    if (write_payload_file(store_fd, tmp_name, environment->payload, environment->payload_size) == -1)
+        return -1;
+    int status = linkat(store_fd, tmp_name, store_fd, key, 0);
+    if (status == -1 && errno == EEXIST)
+        status = 0;
+    int saved_errno = errno;
+    unlinkat(store_fd, tmp_name, 0);
+    errno = saved_errno;
+    return status;
+}
+
+// Function to get the name the file of a staged package is written under
+const char* package_file(package_t* package)
+{
+    return package->staged != NULL ? package->staged : package->name;
+}
+
+// Function to create the package file of an environment as a link to the shared content store
+int link_package_entry(environment_t* environment, package_t* package)
+{
+    char key[STORE_KEY_SIZE];
+    if (store_key(environment, package->name, package->version, key) == -1)
+        return -1;
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        if (linkat(store_fd, key, environment->dir_fd, package_file(package), 0) == 0)
+            return 0;
+        if (errno == ENOENT && attempt == 0)
+        {
+            if (store_payload(environment, key) == -1)
+                return environment_error(environment, "store %s", key);
+            continue;
+        }
+        if (errno == EXDEV || errno == EMLINK || errno == EPERM)
+        {
+            if (clone_package_file(environment, key, package_file(package)) == 0)
+                return 0;
+            return environment_error(environment, "copy %s from store", key);
+        }
+        break;
+    }
+    return environment_error(environment, "link %s", package_file(package));
+}
+
+// Function to delete the package file of a removed package; the store entry it was linked from is
+// collected when the environment held its last reference (only the store link itself remains)
+int delete_package_entry(environment_t* environment, removed_t* package)
+{
+    if (package->replaced)
+    {
+        // The new version takes the place of the old file in one step
+        char staged[MAX_BUFFER_SIZE];
+        snprintf(staged, sizeof(staged), ".%s.new", package->name);
+        if (renameat(environment->dir_fd, staged, environment->dir_fd, package->name) == -1)
+            return environment_error(environment, "rename %s", staged);
+    }
+    else if (unlinkat(environment->dir_fd, package->name, 0) == -1 && errno != ENOENT)
+        return environment_error(environment, "unlink %s", package->name);
+    if (store_fd == -1)
+        return 0;
+    char key[STORE_KEY_SIZE];
+    struct stat st;
+    if (store_key(environment, package->name, package->version, key) == -1)
+        return -1;
+    if (fstatat(store_fd, key, &st, 0) == 0 && st.st_nlink == 1 && unlinkat(store_fd, key, 0) == -1 &&
+        errno != ENOENT)
+        return environment_error(environment, "collect %s", key);
+    return 0;
+}
+
+// Function to create the package file; it must not exist yet
+int add_package_entry(environment_t* environment, package_t* package)
+{
+    if (store_fd != -1)
+        return link_package_entry(environment, package);
+    size_t size = generate_payload(package->name, package->version, environment->payload);
+    if (write_payload_file(environment->dir_fd, package_file(package), environment->payload, size) == -1)
+        return environment_error(environment, "open %s", package_file(package));
+    return 0;
+}
+
+// Function to split "<NAME>==<VERSION>[:<DEPENDENCY>,...]" in place; returns -1 if it is malformed
+int parse_install(char* spec, char** name, char** version, char** depends)
+{
+    char* separator = strstr(spec, "==");
+    if (separator == NULL || separator == spec || separator[2] == '\0' || separator[2] == ':')
+        return -1;
+    *separator = '\0';
+    *name = spec;
+    *version = separator + 2;
+    if ((*depends = strchr(*version, ':')) == NULL)
+        return 0;
+    *(*depends)++ = '\0';
+    // Dependencies are non-empty names separated by single commas
+    char* d = *depends;
+    if (*d == '\0' || *d == ',' || d[strlen(d) - 1] == ',' || strstr(d, ",,") != NULL || strchr(d, ' ') != NULL)
+        return -1;
+    return 0;
+}
+
+int compare_plan_nodes(const void* a, const void* b)
+{
+    return strcmp(((const plan_node_t*)a)->name, ((const plan_node_t*)b)->name);
+}
+
+// Function to find a package in the install plan, returns NULL if the run does not install it
+plan_node_t* plan_find(const char* name)
+{
+    plan_node_t key = {.name = (char*)name};
+    return bsearch(&key, install_plan.nodes, install_plan.count, sizeof(plan_node_t), compare_plan_nodes);
+}
+
+// Function to append a node index to a growing array
+void append_node(int** array, int* count, int node)
+{
+    if ((*array = realloc(*array, sizeof(int) * (*count + 1))) == NULL)
+        ERR("realloc");
+    (*array)[(*count)++] = node;
+}
+
+// Function to report a dependency cycle among the nodes that never became ready, and exit
+void report_cycle(void)
+{
+    int start = 0;
+    while (install_plan.nodes[start].pending == 0)
+        start++;
+    // Every unplaced node has an unplaced dependency, so walking them must revisit a node
+    int* seen = calloc(install_plan.count, sizeof(int));
+    if (seen == NULL)
+        ERR("calloc");
+    int node = start;
+    while (!seen[node])
+    {
+        seen[node] = 1;
+        plan_node_t* current = &install_plan.nodes[node];
+        for (int i = 0; i < current->depends_count; i++)
+            if (install_plan.nodes[current->depends[i]].pending > 0)
+            {
+                node = current->depends[i];
+                break;
+            }
+    }
+    fprintf(stderr, "sop-venv: dependency cycle: %s", install_plan.nodes[node].name);
+    int first = node;
+    do
+    {
+        plan_node_t* current = &install_plan.nodes[node];
+        for (int i = 0; i < current->depends_count; i++)
+            if (install_plan.nodes[current->depends[i]].pending > 0)
+            {
+                node = current->depends[i];
+                break;
+            }
+        fprintf(stderr, " -> %s", install_plan.nodes[node].name);
+    } while (node != first);
+    fprintf(stderr, "\n");
+    free(seen);
+    exit(EXIT_FAILURE);
+}
+
+// Function to build the dependency graph of all installs of the run and sort it into waves (Kahn's
+// algorithm level by level); dependencies that are not installed by the run must already be in each
+// environment and do not constrain the order
+void resolve_install_plan(operation_t* operations, int operation_count)
+{
+    install_plan.nodes = calloc(operation_count > 0 ? operation_count : 1, sizeof(plan_node_t));
+    if (install_plan.nodes == NULL)
+        ERR("calloc");
+    for (int i = 0; i < operation_count; i++)
+    {
+        char *spec, *name, *version, *depends;
+        if (operations[i].kind != 'i')
+            continue;
+        if ((spec = strdup(operations[i].argument)) == NULL)
+            ERR("strdup");
+        // Malformed installs are reported by each environment
+        if (parse_install(spec, &name, &version, &depends) == 0)
+            install_plan.nodes[install_plan.count++].name = strdup(name);
+        free(spec);
+    }
+    qsort(install_plan.nodes, install_plan.count, sizeof(plan_node_t), compare_plan_nodes);
+    int unique = 0;
+    for (int i = 0; i < install_plan.count; i++)
+    {
+        if (unique > 0 && strcmp(install_plan.nodes[unique - 1].name, install_plan.nodes[i].name) == 0)
+            free(install_plan.nodes[i].name);
+        else
+            install_plan.nodes[unique++] = install_plan.nodes[i];
+    }
+    install_plan.count = unique;
+
+    for (int i = 0; i < operation_count; i++)
+    {
+        char *spec, *name, *version, *depends, *saveptr;
+        if (operations[i].kind != 'i')
+            continue;
+        if ((spec = strdup(operations[i].argument)) == NULL)
+            ERR("strdup");
+        if (parse_install(spec, &name, &version, &depends) == 0 && depends != NULL)
+        {
+            int node = plan_find(name) - install_plan.nodes;
+            for (char* d = strtok_r(depends, ",", &saveptr); d != NULL; d = strtok_r(NULL, ",", &saveptr))
+            {
+                plan_node_t* dependency = plan_find(d);
+                if (dependency == NULL)
+                    continue;
+                append_node(&install_plan.nodes[node].depends, &install_plan.nodes[node].depends_count,
+                            dependency - install_plan.nodes);
+                append_node(&dependency->dependents, &dependency->dependents_count, node);
+                install_plan.nodes[node].pending++;
+            }
+        }
+        free(spec);
+    }
+
+    int* ready = malloc(sizeof(int) * (install_plan.count > 0 ? install_plan.count : 1));
+    if (ready == NULL)
+        ERR("malloc");
+    int ready_count = 0;
+    for (int i = 0; i < install_plan.count; i++)
+        if (install_plan.nodes[i].pending == 0)
+            ready[ready_count++] = i;
+    // ready[] is a queue; nodes of one wave are contiguous in it
+    for (int head = 0, wave_end = ready_count; head < ready_count; install_plan.waves++, wave_end = ready_count)
+    {
+        for (; head < wave_end; head++)
+        {
+            plan_node_t* node = &install_plan.nodes[ready[head]];
+            node->wave = install_plan.waves;
+            for (int i = 0; i < node->dependents_count; i++)
+                if (--install_plan.nodes[node->dependents[i]].pending == 0)
+                    ready[ready_count++] = node->dependents[i];
+        }
+    }
+    free(ready);
+    if (ready_count < install_plan.count)
+        report_cycle();
+}
+
+// Function to release the install plan
+void free_install_plan(void)
+{
+    for (int i = 0; i < install_plan.count; i++)
+    {
+        free(install_plan.nodes[i].name);
+        free(install_plan.nodes[i].depends);
+        free(install_plan.nodes[i].dependents);
+    }
+    free(install_plan.nodes);
+}
+
+// Function to find a package removed earlier in the same transaction, returns NULL if there is none
+removed_t* find_removed(transaction_t* transaction, const char* package_name)
+{
+    for (int i = 0; i < transaction->removed_count; i++)
+        if (strcmp(transaction->removed[i].name, package_name) == 0)
+            return &transaction->removed[i];
+    return NULL;
+}
+
+// Function to validate an install against the index and stage it
+int add_new_package(environment_t* environment, requirements_t* requirements, transaction_t* transaction,
+                    char* input_str)
+{
+    char *spec, *package_name, *package_version, *depends;
+    if ((spec = strdup(input_str)) == NULL)
+        ERR("strdup");
+    if (parse_install(spec, &package_name, &package_version, &depends) == -1)
+    {
+        free(spec);
+        errno = EINVAL;
+        return environment_error(environment, "%s: expected <NAME>==<VERSION>[:<DEPENDENCY>,...]", input_str);
+    }
+
+    int status = 0;
+    if (requirements_find(requirements, package_name) != NULL)
+    {
+        errno = EEXIST;
+        status = environment_error(environment, "package %s already exists", package_name);
+    }
+    else
+    {
+        package_t* package = requirements_add(requirements, package_name, package_version, depends);
+        plan_node_t* node = plan_find(package_name);
+        package->fresh = 1;
+        package->wave = node != NULL ? node->wave : 0;
+        // A new version of a package removed by this transaction is written next to the old file
+        removed_t* removed = find_removed(transaction, package_name);
+        if (removed != NULL)
+        {
+            removed->replaced = 1;
+            if (asprintf(&package->staged, ".%s.new", package_name) == -1)
+                ERR("asprintf");
+        }
+    }
+    free(spec);
+    return status;
+}
+
+// Function to check that every dependency of every package in the index is installed as well, which is
+// what makes both an install with missing dependencies and a removal of a required package fail
+int check_dependencies(environment_t* environment, requirements_t* requirements)
+{
+    char dependency[MAX_BUFFER_SIZE];
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
     {
-        if(check_package_exists(buffer, package_name) == 0)
-        { 
-            exists = 1;
+        for (const char* d = package->depends; d != NULL && *d != '\0'; d += strspn(d, ","))
+        {
+            size_t length = strcspn(d, ",");
+            snprintf(dependency, sizeof(dependency), "%.*s", (int)length, d);
+            d += length;
+            if (requirements_find(requirements, dependency) == NULL)
+            {
+                errno = ENOENT;
+                return environment_error(environment, "package %s requires %s", package->name, dependency);
+            }
+        }
+    }
+    return 0;
+}
+
+// Function to validate a removal against the index and stage it
+int remove_package(environment_t* environment, requirements_t* requirements, transaction_t* transaction,
+                   char* package_name)
+{
+    package_t* package = requirements_find(requirements, package_name);
+    if (package == NULL)
+    {
+        errno = ENOENT;
+        return environment_error(environment, "package %s does not exist", package_name);
+    }
+    // A package installed earlier in the same transaction has no file to delete
+    if (package->fresh && package->staged != NULL)
+        find_removed(transaction, package_name)->replaced = 0;
+    if (!package->fresh)
+    {
+        transaction->removed = realloc(transaction->removed, sizeof(removed_t) * (transaction->removed_count + 1));
+        if (transaction->removed == NULL)
+            ERR("realloc");
+        removed_t* removed = &transaction->removed[transaction->removed_count];
+        if ((removed->name = strdup(package->name)) == NULL || (removed->version = strdup(package->version)) == NULL)
+            ERR("strdup");
+        removed->replaced = 0;
+        transaction->removed_count++;
+    }
+    requirements_remove(requirements, package);
+    return 0;
+}
+
+// Function to delete the package files created by a failed transaction
+void rollback_packages(environment_t* environment, requirements_t* requirements)
+{
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+        if (package->written && unlinkat(environment->dir_fd, package_file(package), 0) == -1)
+            perror("unlinkat");
+}
+
+// Function run by the threads of a wave; each writes with a private copy of the environment so payload
+// buffers are not shared, and the first error is copied back
+void* wave_worker(void* arg)
+{
+    wave_t* wave = (wave_t*)arg;
+    environment_t local;
+    local.dir = wave->environment->dir;
+    local.dir_fd = wave->environment->dir_fd;
+    local.failed = 0;
+    int i;
+    while (!__atomic_load_n(&wave->environment->failed, __ATOMIC_RELAXED) &&
+           (i = __atomic_fetch_add(&wave->next, 1, __ATOMIC_RELAXED)) < wave->count)
+    {
+        if (add_package_entry(&local, wave->packages[i]) == -1)
+        {
+            pthread_mutex_lock(&wave->mutex);
+            if (!wave->environment->failed)
+            {
+                memcpy(wave->environment->error, local.error, sizeof(local.error));
+                __atomic_store_n(&wave->environment->failed, 1, __ATOMIC_RELAXED);
+            }
+            pthread_mutex_unlock(&wave->mutex);
             break;
         }
+        wave->packages[i]->written = 1;
+        INSTR_COUNT("venv_package_files", 1);
     }
-    fclose(requirements_file);
-    if(exists == 0)
+    return NULL;
+}
+
+// Function to write the package files of one wave, in parallel when the wave is large enough
+int write_wave(environment_t* environment, package_t** packages, int count)
+{
+    wave_t wave = {environment, packages, count, 0, PTHREAD_MUTEX_INITIALIZER};
+    int thread_count = wave_threads < count ? wave_threads : count;
+    if (thread_count <= 1)
     {
-        add_package_entry(package_name, package_version);
+        wave_worker(&wave);
+        return environment->failed ? -1 : 0;
     }
-    else ERR("Package already exists");
+    pthread_t threads[MAX_THREADS];
+    for (int i = 0; i < thread_count; i++)
+        if ((errno = pthread_create(&threads[i], NULL, wave_worker, &wave)) != 0)
+            ERR("pthread_create");
+    for (int i = 0; i < thread_count; i++)
+        if ((errno = pthread_join(threads[i], NULL)) != 0)
+            ERR("pthread_join");
+    return environment->failed ? -1 : 0;
+}
 
-    chdir(previous_directory);
+int compare_waves(const void* a, const void* b)
+{
+    return (*(package_t* const*)a)->wave - (*(package_t* const*)b)->wave;
 }
 
-// Function to remove a package from the repository
-void remove_package(char *repository_dir, char* package_name)
+// Function to write the files of all staged packages wave by wave, so a package file never exists before
+// the files of its dependencies
+int write_packages(environment_t* environment, requirements_t* requirements)
 {
-    char* previous_directory = change_directory(repository_dir);
-    FILE *file;
-    if((file = fopen(REQUIREMENTS_FILE, "r")) == NULL) 
-        ERR("open");
+    int count = 0;
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+        count += package->fresh;
+    if (count == 0)
+        return 0;
+    package_t** packages = malloc(sizeof(package_t*) * count);
+    if (packages == NULL)
+        ERR("malloc");
+    count = 0;
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+        if (package->fresh)
+            packages[count++] = package;
+    qsort(packages, count, sizeof(package_t*), compare_waves);
 
-    FILE* tmp;
-    if((tmp = fopen("tmp", "w")) == NULL) 
-        ERR("open");
+    int status = 0;
+    for (int start = 0, end; start < count && status == 0; start = end)
+    {
+        for (end = start; end < count && packages[end]->wave == packages[start]->wave; end++)
+            ;
+        status = write_wave(environment, packages + start, end - start);
+    }
+    free(packages);
+    return status;
+}
+
+// Function to take the exclusive lock of an environment; flock on the directory descriptor is per open file
+// description, so it excludes other processes as well as other tasks of this process
+int lock_environment(environment_t* environment)
+{
+    struct timespec start, end;
+    if (flock(environment->dir_fd, LOCK_EX | LOCK_NB) == 0)
+        return 0;
+    if (errno != EWOULDBLOCK)
+        return environment_error(environment, "lock");
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (TEMP_FAILURE_RETRY(flock(environment->dir_fd, LOCK_EX)) == -1)
+        return environment_error(environment, "lock");
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    INSTR_VALUE("venv_lock_wait_ns", (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec));
+    environment->lock_wait_ns += (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+    return 0;
+}
+
+// Function to validate every operation against the index only, so a failure leaves nothing to undo
+void validate_operations(environment_t* environment, requirements_t* requirements, transaction_t* transaction,
+                         operation_t* operations, int operation_count)
+{
+    for (int i = 0; i < operation_count && !environment->failed; i++)
+    {
+        if (operations[i].kind == 'i')
+            add_new_package(environment, requirements, transaction, operations[i].argument);
+        else
+            remove_package(environment, requirements, transaction, operations[i].argument);
+    }
+    if (!environment->failed)
+        check_dependencies(environment, requirements);
+}
+
+// Function to release the removal list of a transaction
+void transaction_free(transaction_t* transaction)
+{
+    for (int i = 0; i < transaction->removed_count; i++)
+    {
+        free(transaction->removed[i].name);
+        free(transaction->removed[i].version);
+    }
+    free(transaction->removed);
+    transaction->removed = NULL;
+    transaction->removed_count = 0;
+}
+
+// Function to read a manifest of "install <NAME>==<VERSION>" and "remove <NAME>" lines into operations
+void load_manifest(const char* path, operation_t** operations, int* operation_count)
+{
+    FILE* manifest;
+    if ((manifest = fopen(path, "r")) == NULL)
+        ERR("open manifest");
 
-    int exists = 0;
-    char* buffer = malloc(MAX_BUFFER_SIZE);
+    char buffer[MAX_BUFFER_SIZE];
+    int line = 0;
+    while (fgets(buffer, MAX_BUFFER_SIZE, manifest) != NULL)
+    {
+        line++;
+        char* command = strtok(buffer, " \t\n");
+        if (command == NULL || command[0] == '#')
+            continue;
+        char* argument = strtok(NULL, " \t\n");
+        char kind = strcmp(command, "install") == 0 ? 'i' : strcmp(command, "remove") == 0 ? 'r' : 0;
+        if (kind == 0 || argument == NULL || strtok(NULL, " \t\n") != NULL)
+        {
+            fprintf(stderr, "sop-venv: %s:%d: expected install <NAME>==<VERSION> or remove <NAME>\n", path, line);
+            exit(EXIT_FAILURE);
+        }
+        *operations = realloc(*operations, sizeof(operation_t) * (*operation_count + 1));
+        if (*operations == NULL || ((*operations)[*operation_count].argument = strdup(argument)) == NULL)
+            ERR("malloc");
+        (*operations)[*operation_count].kind = kind;
+        (*operation_count)++;
+    }
+    fclose(manifest);
+}
 
-    while(fgets(buffer, MAX_BUFFER_SIZE, file) != NULL)
+// Function to release a list of operations
+void free_operations(operation_t* operations, int operation_count)
+{
+    for (int i = 0; i < operation_count; i++)
+        free(operations[i].argument);
+    free(operations);
+}
+
+// Function to append an operation, the argument is taken over
+void append_operation(operation_t** operations, int* operation_count, char kind, char* argument)
+{
+    if ((*operations = realloc(*operations, sizeof(operation_t) * (*operation_count + 1))) == NULL)
+        ERR("realloc");
+    (*operations)[*operation_count].kind = kind;
+    (*operations)[*operation_count].argument = argument;
+    (*operation_count)++;
+}
+
+// Function to build the install argument of a package, "<NAME>==<VERSION>[:<DEPENDENCY>,...]"
+char* install_argument(const char* name, const char* version, const char* depends)
+{
+    char* argument;
+    if (asprintf(&argument, "%s==%s%s%s", name, version, depends ? ":" : "", depends ? depends : "") == -1)
+        ERR("asprintf");
+    return argument;
+}
+
+int compare_entries(const void* a, const void* b)
+{
+    return strcmp(((const entry_t*)a)->name, ((const entry_t*)b)->name);
+}
+
+int compare_package_names(const void* a, const void* b)
+{
+    return strcmp((*(package_t* const*)a)->name, (*(package_t* const*)b)->name);
+}
+
+// Function to compare optional dependency lists
+int same_depends(const char* a, const char* b)
+{
+    return strcmp(a ? a : "", b ? b : "") == 0;
+}
+
+// Function to compute the minimal operations that turn a target into the sync source: both sides are
+// walked in name order (a sorted merge), a package only in the source is installed, a package only in the
+// target is removed, and a package whose version or dependencies differ is replaced
+void diff_sync_source(requirements_t* target, operation_t** operations, int* operation_count)
+{
+    *operations = NULL;
+    *operation_count = 0;
+    package_t** packages = malloc(sizeof(package_t*) * (target->count > 0 ? target->count : 1));
+    if (packages == NULL)
+        ERR("malloc");
+    int count = 0;
+    for (package_t* package = target->head; package != NULL; package = package->next)
+        packages[count++] = package;
+    qsort(packages, count, sizeof(package_t*), compare_package_names);
+
+    int i = 0, j = 0;
+    while (i < sync_source.count || j < count)
     {
-        if(check_package_exists(buffer, package_name) == 0)
-        { 
-            exists = 1;
+        entry_t* entry = i < sync_source.count ? &sync_source.entries[i] : NULL;
+        package_t* package = j < count ? packages[j] : NULL;
+        int order = entry == NULL ? 1 : package == NULL ? -1 : strcmp(entry->name, package->name);
+        if (order > 0 || (order == 0 && (strcmp(entry->version, package->version) != 0 ||
+                                         !same_depends(entry->depends, package->depends))))
+        {
+            char* name = strdup(package->name);
+            if (name == NULL)
+                ERR("strdup");
+            append_operation(operations, operation_count, 'r', name);
         }
-        else fputs(buffer, tmp);
+        if (order < 0 || (order == 0 && (strcmp(entry->version, package->version) != 0 ||
+                                         !same_depends(entry->depends, package->depends))))
+            append_operation(operations, operation_count, 'i',
+                             install_argument(entry->name, entry->version, entry->depends));
+        if (order <= 0)
+            i++;
+        if (order >= 0)
+            j++;
+    }
+    free(packages);
+}
+
+// Function to copy an index into a package set sorted by name
+void set_from_requirements(requirements_t* requirements, package_set_t* set)
+{
+    set->count = 0;
+    if ((set->entries = malloc(sizeof(entry_t) * (requirements->count > 0 ? requirements->count : 1))) == NULL)
+        ERR("malloc");
+    for (package_t* package = requirements->head; package != NULL; package = package->next)
+    {
+        entry_t* entry = &set->entries[set->count++];
+        if ((entry->name = strdup(package->name)) == NULL || (entry->version = strdup(package->version)) == NULL ||
+            (package->depends != NULL && (entry->depends = strdup(package->depends)) == NULL))
+            ERR("strdup");
+        if (package->depends == NULL)
+            entry->depends = NULL;
+    }
+    qsort(set->entries, set->count, sizeof(entry_t), compare_entries);
+}
+
+// Function to release a package set
+void free_package_set(package_set_t* set)
+{
+    for (int i = 0; i < set->count; i++)
+    {
+        free(set->entries[i].name);
+        free(set->entries[i].version);
+        free(set->entries[i].depends);
     }
-    fclose(file);
-    fclose(tmp);
+    free(set->entries);
+    set->entries = NULL;
+    set->count = 0;
+}
+
+// Function to read the requirements of an environment directory into a package set, exits on failure
+void load_environment_set(const char* dir, package_set_t* set)
+{
+    environment_t environment;
+    requirements_t requirements;
+    memset(&environment, 0, sizeof(environment));
+    environment.dir = (char*)dir;
+    if ((environment.dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) == -1)
+        environment_error(&environment, "the environment does not exist");
+    else
+    {
+        requirements_load(&environment, &requirements);
+        set_from_requirements(&requirements, set);
+        requirements_free(&requirements);
+        close(environment.dir_fd);
+    }
+    if (environment.failed)
+    {
+        fprintf(stderr, "sop-venv: %s: %s\n", dir, environment.error);
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Fields come from requirements lines read into MAX_BUFFER_SIZE buffers, so their lengths always fit
+_Static_assert(MAX_BUFFER_SIZE <= UINT16_MAX, "snapshot field lengths are stored in 16 bits");
 
-    if(exists == 1)
+// Function to write a snapshot of an environment: a magic, the package count and, for every package in
+// name order, the lengths of its name, version and dependencies followed by the strings themselves
+void write_snapshot(const char* dir, const char* path)
+{
+    package_set_t set;
+    load_environment_set(dir, &set);
+    size_t size = sizeof(SNAPSHOT_MAGIC) - 1 + sizeof(uint32_t);
+    for (int i = 0; i < set.count; i++)
+        size += 3 * sizeof(uint16_t) + strlen(set.entries[i].name) + strlen(set.entries[i].version) +
+                (set.entries[i].depends ? strlen(set.entries[i].depends) : 0);
+    char* buffer = malloc(size);
+    if (buffer == NULL)
+        ERR("malloc");
+    char* position = buffer;
+    memcpy(position, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1);
+    position += sizeof(SNAPSHOT_MAGIC) - 1;
+    uint32_t count = set.count;
+    memcpy(position, &count, sizeof(count));
+    position += sizeof(count);
+    for (int i = 0; i < set.count; i++)
     {
-        if(unlink(REQUIREMENTS_FILE) == -1) ERR("unlink");
-        if(unlink(package_name) == -1) ERR("unlink");
-        rename("tmp", REQUIREMENTS_FILE);
+        const char* fields[3] = {set.entries[i].name, set.entries[i].version, set.entries[i].depends};
+        uint16_t lengths[3];
+        for (int f = 0; f < 3; f++)
+            lengths[f] = fields[f] ? strlen(fields[f]) : 0;
+        memcpy(position, lengths, sizeof(lengths));
+        position += sizeof(lengths);
+        for (int f = 0; f < 3; f++)
+        {
+            memcpy(position, fields[f] ? fields[f] : "", lengths[f]);
+            position += lengths[f];
+        }
     }
-    else if(unlink("tmp") == -1) ERR("unlink");
-    
+
+    // Written next to the destination and renamed, so an existing snapshot is replaced atomically
+    char* tmp_path;
+    int fd;
+    if (asprintf(&tmp_path, "%s.tmp", path) == -1)
+        ERR("asprintf");
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+        ERR("open snapshot");
+    if (bulk_write(fd, buffer, size) < 0 || fsync(fd) == -1)
+        ERR("write snapshot");
+    close(fd);
+    if (rename(tmp_path, path) == -1)
+        ERR("rename snapshot");
+    printf("Snapshot of %s: %d packages, %zu bytes\n", dir, set.count, size);
+    free(tmp_path);
     free(buffer);
-    chdir(previous_directory);
+    free_package_set(&set);
+}
+
+// Function to read one string field of a snapshot entry; returns NULL if the snapshot is truncated
+char* read_snapshot_field(const char** position, const char* end, uint16_t length)
+{
+    if (end - *position < length)
+        return NULL;
+    char* field = strndup(*position, length);
+    if (field == NULL)
+        ERR("strndup");
+    *position += length;
+    return field;
+}
+
+// Function to parse a snapshot loaded into memory; returns -1 if it is malformed
+int parse_snapshot(const char* data, size_t size, package_set_t* set)
+{
+    const char* position = data + sizeof(SNAPSHOT_MAGIC) - 1;
+    const char* end = data + size;
+    uint32_t count;
+    if ((size_t)(end - position) < sizeof(count))
+        return -1;
+    memcpy(&count, position, sizeof(count));
+    position += sizeof(count);
+    // Every entry takes at least its three lengths, which bounds a bogus count before allocating
+    if (count > (size_t)(end - position) / (3 * sizeof(uint16_t)))
+        return -1;
+    if ((set->entries = calloc(count > 0 ? count : 1, sizeof(entry_t))) == NULL)
+        ERR("calloc");
+    for (set->count = 0; set->count < (int)count; set->count++)
+    {
+        uint16_t lengths[3];
+        entry_t* entry = &set->entries[set->count];
+        if ((size_t)(end - position) < sizeof(lengths))
+            return -1;
+        memcpy(lengths, position, sizeof(lengths));
+        position += sizeof(lengths);
+        if (lengths[0] == 0 || lengths[1] == 0 || (entry->name = read_snapshot_field(&position, end, lengths[0])) == NULL ||
+            (entry->version = read_snapshot_field(&position, end, lengths[1])) == NULL ||
+            (lengths[2] > 0 && (entry->depends = read_snapshot_field(&position, end, lengths[2])) == NULL))
+            return -1;
+        if (set->count > 0 && strcmp(set->entries[set->count - 1].name, entry->name) >= 0)
+            return -1;
+    }
+    return position == end ? 0 : -1;
+}
+
+// Function to load the source of a sync: an environment directory, a snapshot, or a manifest made only of
+// install lines
+void load_sync_source(const char* path, package_set_t* set)
+{
+    struct stat st;
+    if (stat(path, &st) == -1)
+        ERR("stat sync source");
+    if (S_ISDIR(st.st_mode))
+    {
+        load_environment_set(path, set);
+        return;
+    }
+
+    int fd;
+    char* data;
+    if ((fd = open(path, O_RDONLY)) == -1)
+        ERR("open sync source");
+    if ((data = malloc(st.st_size + 1)) == NULL)
+        ERR("malloc");
+    ssize_t size = 0, c;
+    while (size < st.st_size && (c = TEMP_FAILURE_RETRY(read(fd, data + size, st.st_size - size))) > 0)
+        size += c;
+    if (size < st.st_size)
+        ERR("read sync source");
+    close(fd);
+    data[size] = '\0';
+    if ((size_t)size >= sizeof(SNAPSHOT_MAGIC) - 1 && memcmp(data, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC) - 1) == 0)
+    {
+        if (parse_snapshot(data, size, set) == -1)
+        {
+            fprintf(stderr, "sop-venv: %s: malformed snapshot\n", path);
+            exit(EXIT_FAILURE);
+        }
+        free(data);
+        return;
+    }
+    free(data);
+
+    operation_t* operations = NULL;
+    int operation_count = 0;
+    load_manifest(path, &operations, &operation_count);
+    if ((set->entries = calloc(operation_count > 0 ? operation_count : 1, sizeof(entry_t))) == NULL)
+        ERR("calloc");
+    set->count = 0;
+    for (int i = 0; i < operation_count; i++)
+    {
+        char *name, *version, *depends;
+        if (operations[i].kind != 'i' || parse_install(operations[i].argument, &name, &version, &depends) == -1)
+        {
+            fprintf(stderr, "sop-venv: %s: a sync manifest may only contain valid install lines\n", path);
+            exit(EXIT_FAILURE);
+        }
+        entry_t* entry = &set->entries[set->count++];
+        if ((entry->name = strdup(name)) == NULL || (entry->version = strdup(version)) == NULL ||
+            (depends != NULL && (entry->depends = strdup(depends)) == NULL))
+            ERR("strdup");
+    }
+    free_operations(operations, operation_count);
+    qsort(set->entries, set->count, sizeof(entry_t), compare_entries);
+    for (int i = 1; i < set->count; i++)
+        if (strcmp(set->entries[i - 1].name, set->entries[i].name) == 0)
+        {
+            fprintf(stderr, "sop-venv: %s: package %s is listed twice\n", path, set->entries[i].name);
+            exit(EXIT_FAILURE);
+        }
+}
+
+// Function to apply all operations to one environment as a single transaction
+void process_environment(environment_t* environment, operation_t* operations, int operation_count)
+{
+    INSTR_SCOPE("venv_transaction");
+    if ((environment->dir_fd = open(environment->dir, O_RDONLY | O_DIRECTORY)) == -1)
+    {
+        environment_error(environment, "the environment does not exist");
+        return;
+    }
+
+    // Loading and validation run optimistically without the lock; the lock is held only to write and commit,
+    // after checking that nobody committed in between. A transaction that keeps losing that race runs its
+    // last attempt entirely under the lock
+    requirements_t requirements;
+    transaction_t transaction = {NULL, 0};
+    for (int attempt = 0; !environment->failed; attempt++)
+    {
+        int locked = attempt >= MAX_OPTIMISTIC_ATTEMPTS;
+        if (locked && lock_environment(environment) == -1)
+            break;
+        if (requirements_load(environment, &requirements) == -1)
+        {
+            requirements_free(&requirements);
+            break;
+        }
+        if (syncing)
+        {
+            // The operations of a sync depend on the current contents, so they are derived on every attempt
+            operation_t* sync_operations;
+            int sync_count;
+            diff_sync_source(&requirements, &sync_operations, &sync_count);
+            validate_operations(environment, &requirements, &transaction, sync_operations, sync_count);
+            free_operations(sync_operations, sync_count);
+        }
+        else
+            validate_operations(environment, &requirements, &transaction, operations, operation_count);
+        if (!environment->failed && !locked)
+        {
+            if (lock_environment(environment) == -1)
+            {
+                requirements_free(&requirements);
+                break;
+            }
+            if (!requirements_unchanged(environment, &requirements))
+            {
+                flock(environment->dir_fd, LOCK_UN);
+                requirements_free(&requirements);
+                transaction_free(&transaction);
+                environment->retries++;
+                INSTR_COUNT("venv_retries", 1);
+                continue;
+            }
+        }
+
+        // Phase 2 writes the new package files, phase 3 commits the requirements with one rename
+        if (!environment->failed &&
+            (write_packages(environment, &requirements) == -1 || requirements_save(environment, &requirements) == -1))
+            rollback_packages(environment, &requirements);
+        else if (!environment->failed)
+            environment->committed = 1;
+
+        // Phase 4 deletes the files of removed packages, only once the commit succeeded
+        for (int i = 0; i < transaction.removed_count && !environment->failed; i++)
+            delete_package_entry(environment, &transaction.removed[i]);
+        requirements_free(&requirements);
+        break;
+    }
+    transaction_free(&transaction);
+    // Closing the descriptor releases the lock
+    close(environment->dir_fd);
+}
+
+// Thread pool worker, takes one environment at a time until none are left
+void* environment_worker(void* arg)
+{
+    work_t* work = (work_t*)arg;
+    int i;
+    while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) < work->environment_count)
+    {
+        process_environment(&work->environments[i], work->operations, work->operation_count);
+        INSTR_TICK();
+    }
+    return NULL;
+}
+
+// Function to process all environments on a pool of threads, returns the number of failed environments
+int process_environments(work_t* work, int thread_count)
+{
+    pthread_t threads[MAX_THREADS];
+    if (thread_count > work->environment_count)
+        thread_count = work->environment_count;
+    for (int i = 0; i < thread_count; i++)
+        if ((errno = pthread_create(&threads[i], NULL, environment_worker, work)) != 0)
+            ERR("pthread_create");
+    for (int i = 0; i < thread_count; i++)
+        if ((errno = pthread_join(threads[i], NULL)) != 0)
+            ERR("pthread_join");
+
+    int failed = 0;
+    long long total_wait_ns = 0;
+    for (int i = 0; i < work->environment_count; i++)
+    {
+        total_wait_ns += work->environments[i].lock_wait_ns;
+        if (report_locks)
+            printf("%s: lock wait %.3f ms, %d retries\n", work->environments[i].dir,
+                   work->environments[i].lock_wait_ns / 1e6, work->environments[i].retries);
+        if (work->environments[i].failed && work->environments[i].committed)
+        {
+            fprintf(stderr, "sop-venv: %s: %s, the requirements were already committed and files of "
+                    "removed packages may remain\n", work->environments[i].dir, work->environments[i].error);
+            failed++;
+        }
+        else if (work->environments[i].failed)
+        {
+            fprintf(stderr, "sop-venv: %s: %s, environment left unchanged\n", work->environments[i].dir,
+                    work->environments[i].error);
+            failed++;
+        }
+    }
+    if (report_locks)
+        printf("Total lock wait %.3f ms\n", total_wait_ns / 1e6);
+    return failed;
+}
+
+// Function to walk the content store; every entry is stat'ed and passed to the visitor with its name
+void scan_store(void (*visit)(const char* name, struct stat* st, void* arg), void* arg)
+{
+    int fd;
+    DIR* store;
+    struct dirent* entry;
+    struct stat st;
+    if ((fd = dup(store_fd)) == -1 || (store = fdopendir(fd)) == NULL)
+        ERR("fdopendir");
+    rewinddir(store);
+    while ((errno = 0, entry = readdir(store)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        if (fstatat(store_fd, entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1)
+        {
+            if (errno == ENOENT)
+                continue;
+            ERR("fstatat");
+        }
+        if (S_ISREG(st.st_mode))
+            visit(entry->d_name, &st, arg);
+    }
+    if (errno != 0)
+        ERR("readdir");
+    closedir(store);
+}
+
+// Totals of the content store reported by the stats command
+typedef struct
+{
+    long entries;
+    long references;  // Environment files linked to an entry
+    long long stored; // Bytes held by the store
+    long long linked; // Bytes the linked environment files would take as separate copies
+} store_stats_t;
+
+void collect_entry(const char* name, struct stat* st, void* arg)
+{
+    int* collected = arg;
+    // Entries nobody links to any more, and temporary files an interrupted installer left long enough ago
+    // that they cannot belong to one still running
+    if ((name[0] != '.' && st->st_nlink == 1) || (name[0] == '.' && st->st_mtime < time(NULL) - STALE_TMP_SECONDS))
+    {
+        if (unlinkat(store_fd, name, 0) == -1 && errno != ENOENT)
+            ERR("unlinkat");
+        (*collected)++;
+    }
+}
+
+void count_entry(const char* name, struct stat* st, void* arg)
+{
+    store_stats_t* stats = arg;
+    if (name[0] == '.')
+        return;
+    stats->entries++;
+    stats->references += st->st_nlink - 1;
+    stats->stored += st->st_size;
+    stats->linked += (long long)st->st_size * (st->st_nlink - 1);
+}
+
+// Function to delete every store entry whose reference count dropped to zero
+void collect_store(void)
+{
+    int collected = 0;
+    scan_store(collect_entry, &collected);
+    printf("Collected %d unreferenced store entries\n", collected);
+}
+
+// Function to report how much the store saves compared with one copy per environment
+void print_store_stats(void)
+{
+    store_stats_t stats = {0, 0, 0, 0};
+    scan_store(count_entry, &stats);
+    printf("Store entries:     %ld\n", stats.entries);
+    printf("References:        %ld\n", stats.references);
+    printf("Stored bytes:      %lld\n", stats.stored);
+    printf("Referenced bytes:  %lld\n", stats.linked);
+    printf("Bytes saved:       %lld\n", stats.linked > stats.stored ? stats.linked - stats.stored : 0);
+    printf("Dedup ratio:       %.2f\n", stats.stored > 0 ? (double)stats.linked / stats.stored : 0.0);
+}
+
+// Function to display usage instructions
+void usage(char* name)
+{
+    fprintf(stderr, "usage: %s -c -v <ENVIRONMENT_NAME>\n", name);
+    fprintf(stderr, "       %s [-t threads] -v <ENVIRONMENT_NAME>... [-i <PACKAGE_NAME>==<VERSION>[:<DEPENDENCY>,...]]...\n", name);
+    fprintf(stderr, "          [-r <PACKAGE_NAME>]...\n");
+    fprintf(stderr, "       %s [-t threads] -v <ENVIRONMENT_NAME>... -y <SOURCE_ENVIRONMENT|SNAPSHOT|MANIFEST>\n", name);
+    fprintf(stderr, "       %s -v <ENVIRONMENT_NAME> -o <SNAPSHOT>\n", name);
+    fprintf(stderr, "          [-b <MANIFEST>] [-s <STORE_DIR>] [-w]\n");
+    fprintf(stderr, "       %s -s <STORE_DIR> [-g] [-S]\n", name);
+    exit(EXIT_FAILURE);
 }
 
 int main(int argc, char** argv)
@@ -155,11 +1591,15 @@ int main(int argc, char** argv)
     char** repository_dirs = NULL;
     int dir_count = 0;
     int create_new = 0;
-    char* input_package = NULL;
-    char* remove_package_name = NULL;
+    int collect = 0, stats = 0;
+    char* sync_path = NULL;
+    char* snapshot_path = NULL;
+    operation_t* operations = NULL;
+    int operation_count = 0;
+    long thread_count = sysconf(_SC_NPROCESSORS_ONLN);
 
     int option = 0;
-    while ((option = getopt(argc, argv, "c::v:i:r:")) != -1)
+    while ((option = getopt(argc, argv, "c::v:i:r:t:b:s:gSwy:o:")) != -1)
         switch (option)
         {
             case 'c':
@@ -171,35 +1611,104 @@ int main(int argc, char** argv)
                 dir_count++;
                 break;
             case 'i':
-                input_package = optarg;
-                break;
             case 'r':
-                remove_package_name = optarg;
+                operations = realloc(operations, sizeof(operation_t) * (operation_count + 1));
+                operations[operation_count].kind = option;
+                if ((operations[operation_count].argument = strdup(optarg)) == NULL)
+                    ERR("strdup");
+                operation_count++;
+                break;
+            case 'b':
+                load_manifest(optarg, &operations, &operation_count);
+                break;
+            case 's':
+                if (store_fd != -1)
+                    usage(argv[0]);
+                if (mkdir(optarg, 0755) == -1 && errno != EEXIST)
+                    ERR("mkdir");
+                if ((store_fd = open(optarg, O_RDONLY | O_DIRECTORY)) == -1)
+                    ERR("open");
+                break;
+            case 'g':
+                collect = 1;
+                break;
+            case 'S':
+                stats = 1;
+                break;
+            case 'w':
+                report_locks = 1;
+                break;
+            case 'y':
+                sync_path = optarg;
+                break;
+            case 'o':
+                snapshot_path = optarg;
+                break;
+            case 't':
+                thread_count = atoi(optarg);
+                if (thread_count < 1)
+                    usage(argv[0]);
                 break;
             case '?':
             default:
-                ERR("Invalid argument");
+                usage(argv[0]);
         }
+    if ((collect || stats) && store_fd == -1)
+        usage(argv[0]);
+    if ((sync_path != NULL && operation_count > 0) ||
+        (snapshot_path != NULL && (dir_count != 1 || operation_count > 0 || sync_path != NULL)))
+        usage(argv[0]);
+    if (thread_count < 1)
+        thread_count = 1;
+    if (thread_count > MAX_THREADS)
+        thread_count = MAX_THREADS;
 
-    if (create_new) 
+    if (create_new)
     {
         if(dir_count != 1) ERR("Incorrect number of arguments");
         else create_repository(repository_dirs[0]);
     }
 
-    if(input_package != NULL)
+    if (snapshot_path != NULL)
+        write_snapshot(repository_dirs[0], snapshot_path);
+
+    if (sync_path != NULL)
     {
-        srand(time(NULL));
-        for (int i = 0; i < dir_count; i++)
-            add_new_package(input_package, repository_dirs[i]);
+        // Every package of the source may have to be installed somewhere, so they all go into the plan
+        load_sync_source(sync_path, &sync_source);
+        syncing = 1;
+        for (int i = 0; i < sync_source.count; i++)
+            append_operation(&operations, &operation_count, 'i',
+                             install_argument(sync_source.entries[i].name, sync_source.entries[i].version,
+                                              sync_source.entries[i].depends));
     }
 
-    if(remove_package_name != NULL)
+    // Without any -v there is no environment to apply the operations to
+    int failed = 0;
+    if((operation_count > 0 || syncing) && dir_count > 0)
     {
+        resolve_install_plan(operations, operation_count);
+        environment_t* environments = calloc(dir_count, sizeof(environment_t));
+        if (environments == NULL)
+            ERR("calloc");
         for (int i = 0; i < dir_count; i++)
-            remove_package(repository_dirs[i], remove_package_name);
+            environments[i].dir = repository_dirs[i];
+        // Threads left over by the environment pool write independent packages of a wave in parallel
+        wave_threads = dir_count < thread_count ? thread_count / dir_count : 1;
+        work_t work = {environments, dir_count, 0, operations, operation_count};
+        failed = process_environments(&work, thread_count);
+        free(environments);
+        free_install_plan();
     }
-    
+
+    free_operations(operations, operation_count);
+    free_package_set(&sync_source);
     free(repository_dirs);
-    return EXIT_SUCCESS;
+    if (collect)
+        collect_store();
+    if (stats)
+        print_store_stats();
+    if (store_fd != -1)
+        close(store_fd);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -9,6 +9,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "../Instrumentation/sop-instr.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
@@ -84,8 +86,10 @@ void child_process(int child_id, int start_position, int segment_length, char* f
     int capitalize = 1;
     for (int i = 0; i < segment_length; i++)
     {
+        INSTR_TIMER_START(read_start);
         if ((read_count = read(input_fd, buffer, 1)) < 0)
             ERR("read");
+        INSTR_TIMER_STOP("ft_read", read_start);
 
         // Capitalize every second letter
         if (('a' <= buffer && buffer <= 'z' ) || ('A' <= buffer && buffer <= 'Z')) capitalize++;
@@ -101,8 +105,12 @@ void child_process(int child_id, int start_position, int segment_length, char* f
         if (sigint_flag) break;
         sleep_with_interrupt(delay);
 
+        INSTR_TIMER_START(write_start);
          if ((read_count = write(output_fd, buffer, read_count)) < 0)
             ERR("write");
+        INSTR_TIMER_STOP("ft_write", write_start);
+        INSTR_COUNT("ft_bytes", read_count);
+        INSTR_TICK();
         
     }
     free(buffer);
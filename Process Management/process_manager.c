@@ -1,23 +1,109 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
+
+#include "../Instrumentation/sop-instr.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
-volatile sig_atomic_t sig_count = 0;
-volatile sig_atomic_t last_signal = 0;
+#define DEFAULT_PERIOD_US 10000     // Time between triggers sent by the parent
+#define DEFAULT_DURATION_MS 1000    // Time the parent keeps triggering
+#define DIRECT_ALIGN 4096           // Alignment of buffers, offsets and sizes for O_DIRECT
+#define PREALLOC_CHUNK (64 << 20)   // File space reserved ahead of the batched writer
+#define TRIGGER_RING 4096           // Send times of the latest triggers kept for the latency of the children
+#define MAX_NODES 64                // NUMA nodes looked up for pinning
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+// Ways to start a child
+#define SPAWN_FORK 0                // fork, the child runs child_work directly
+#define SPAWN_VFORK 1               // vfork and exec this program again in child mode
+#define SPAWN_POSIX 2               // posix_spawn of this program in child mode
+
+extern char **environ;
+
+volatile sig_atomic_t sig_count = 0; // Triggers received and not written yet
+volatile sig_atomic_t finish = 0;    // Set by SIGUSR2 at the end of the run
+struct timespec pending_since; // Arrival of the oldest trigger not written yet, set in the handler
+
+// Trigger channel shared by the parent and all children. The parent counts triggers in seq and wakes the
+// children with one futex wake; each child remembers how many it served, so none is lost and a child that
+// falls behind writes all missing blocks in its next batch
+typedef struct {
+    uint32_t seq;           // Futex word: triggers sent so far
+    uint32_t done;          // Set when the parent stops triggering
+    uint32_t waiters;       // Children sleeping on seq, the parent skips the wake-up when there are none
+    struct timespec sent_at[TRIGGER_RING]; // Send time of trigger k at k % TRIGGER_RING
+    long delivered[];       // Triggers served by each child
+} trigger_t;
+
+// Writer options, shared by all children
+int signals = 0;        // Trigger with SIGUSR1 instead of the shared counter
+int batched = 0;        // Coalesce pending blocks into pwritev calls
+int direct = 0;         // Open the file with O_DIRECT
+int sync_range = 0;     // Control write-back with sync_file_range
+
+// Statistics of a child's writer
+typedef struct {
+    long blocks;            // Blocks written
+    long writes;            // write/pwritev calls
+    long long bytes;
+    long long write_ns;     // Time spent in write calls
+    long long latency_ns;   // Sum over batches of the age of their oldest trigger when written
+    long long max_latency_ns;
+    long batches;
+} writer_stats_t;
+
+// Function returning nanoseconds between two times
+long long elapsed_ns(struct timespec *from, struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000LL + (to->tv_nsec - from->tv_nsec);
+}
 
 // Signal handler function
 void sig_handler(int sig) {
-    sig_count++;
-    last_signal = sig;
+    if (sig == SIGUSR1) {
+        // Only the first trigger of a batch starts the latency clock; clock_gettime is async-signal-safe
+        if (sig_count == 0)
+            clock_gettime(CLOCK_MONOTONIC, &pending_since);
+        sig_count++;
+    }
+    if (sig == SIGUSR2)
+        finish = 1;
+}
+
+// Function to wait on a futex word shared between processes while it holds the expected value
+void futex_wait(uint32_t *word, uint32_t expected)
+{
+    if (syscall(SYS_futex, word, FUTEX_WAIT, expected, NULL, NULL, 0) < 0 && errno != EAGAIN && errno != EINTR)
+        ERR("futex");
+}
+
+// Function to wake all waiters on a futex word shared between processes
+void futex_wake_all(uint32_t *word)
+{
+    if (syscall(SYS_futex, word, FUTEX_WAKE, INT_MAX, NULL, NULL, 0) < 0)
+        ERR("futex");
 }
 
 // Function to set a signal handler
@@ -31,24 +117,6 @@ void sethandler(void (*f)(int), int sigNo)
         ERR("sigaction");
 }
 
-// Handler for SIGCHLD to properly handle terminated child processes
-void sigchld_handler(int sig)
-{
-    pid_t pid;
-    for (;;)
-    {
-        pid = waitpid(0, NULL, WNOHANG);
-        if (pid == 0)
-            return;
-        if (pid <= 0)
-        {
-            if (errno == ECHILD)
-                return;
-            ERR("waitpid");
-        }
-    }
-}
-
 // Function for safe bulk writing to a file descriptor
 ssize_t bulk_write(int fd, char *buf, size_t s)
 {
@@ -66,16 +134,143 @@ ssize_t bulk_write(int fd, char *buf, size_t s)
     return len;
 }
 
+// Function writing count copies of a block at offset with as few pwritev calls as possible,
+// returns the number of calls or -1 on error
+long bulk_pwritev(int fd, char *buf, size_t s, long count, off_t offset)
+{
+    struct iovec iov[IOV_MAX];
+    size_t total = (size_t)count * s, done = 0;
+    long calls = 0;
+    while (done < total)
+    {
+        // After a short write the first vector starts inside a block
+        int n = 0;
+        for (size_t at = done; at < total && n < IOV_MAX; n++)
+        {
+            iov[n].iov_base = buf + at % s;
+            iov[n].iov_len = s - at % s;
+            at += iov[n].iov_len;
+        }
+        ssize_t c = TEMP_FAILURE_RETRY(pwritev(fd, iov, n, offset + done));
+        if (c < 0)
+            return -1;
+        done += c;
+        calls++;
+    }
+    return calls;
+}
+
+// Function to write the pending blocks of a batch and account for them
+void write_batch(int out, char *buf, size_t s, long count, off_t *offset, off_t *reserved, off_t *previous,
+                 writer_stats_t *stats)
+{
+    INSTR_SCOPE("pm_write_batch");
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t len = (size_t)count * s;
+    if (!batched)
+    {
+        // One synchronous write per trigger
+        for (long i = 0; i < count; i++)
+            if (bulk_write(out, buf, s) < 0)
+                ERR("write");
+        stats->writes += count;
+    }
+    else
+    {
+        // Reserve space ahead so the pwritev calls do not allocate blocks as they go
+        if (*reserved >= 0 && *offset + (off_t)len > *reserved)
+        {
+            off_t grow = len > PREALLOC_CHUNK ? len : PREALLOC_CHUNK;
+            if (fallocate(out, FALLOC_FL_KEEP_SIZE, *reserved, *offset + grow - *reserved) == 0)
+                *reserved = *offset + grow;
+            else if (errno == EOPNOTSUPP)
+                *reserved = -1;
+            else
+                ERR("fallocate");
+        }
+        long calls = bulk_pwritev(out, buf, s, count, *offset);
+        if (calls < 0)
+            ERR("pwritev");
+        stats->writes += calls;
+        if (sync_range)
+        {
+            // Start write-back of this batch and wait for the previous one, so dirty pages stay bounded
+            if (sync_file_range(out, *offset, len, SYNC_FILE_RANGE_WRITE))
+                ERR("sync_file_range");
+            if (*offset > *previous &&
+                sync_file_range(out, *previous, *offset - *previous,
+                                SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+                ERR("sync_file_range");
+            *previous = *offset;
+        }
+        *offset += len;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats->blocks += count;
+    stats->bytes += len;
+    INSTR_COUNT("pm_blocks", count);
+    INSTR_COUNT("pm_bytes", len);
+    stats->write_ns += elapsed_ns(&start, &end);
+}
+
+// Function to wait for SIGUSR1 triggers, returns how many are pending (0 when the run is over) and when the
+// oldest arrived. The signal stays unblocked until the next call, so triggers arriving meanwhile are counted
+long take_signal_triggers(sigset_t *oldmask, struct timespec *since)
+{
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    while (sig_count == 0 && !finish)
+        sigsuspend(oldmask);
+    long count = sig_count;
+    *since = pending_since;
+    sig_count = 0;
+    sigprocmask(SIG_SETMASK, oldmask, NULL);
+    return count;
+}
+
+// Function to wait for triggers on the shared counter, returns how many are pending (0 when the run is over)
+// and when the oldest was sent
+long take_counter_triggers(trigger_t *trigger, uint32_t *served, struct timespec *since)
+{
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&trigger->seq, __ATOMIC_SEQ_CST)) == *served)
+    {
+        if (__atomic_load_n(&trigger->done, __ATOMIC_SEQ_CST))
+            return 0;
+        // Announced before the recheck, so a parent incrementing seq after it sees a waiter and wakes us
+        __atomic_add_fetch(&trigger->waiters, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&trigger->seq, __ATOMIC_SEQ_CST) == *served &&
+            !__atomic_load_n(&trigger->done, __ATOMIC_SEQ_CST))
+            futex_wait(&trigger->seq, *served);
+        __atomic_sub_fetch(&trigger->waiters, 1, __ATOMIC_SEQ_CST);
+    }
+    long count = seq - *served;
+    // A child more than TRIGGER_RING behind only finds the oldest send time still kept
+    *since = trigger->sent_at[(count > TRIGGER_RING ? seq - TRIGGER_RING : *served) % TRIGGER_RING];
+    *served = seq;
+    return count;
+}
+
 // Function executed by child processes
-void child_work(int n, sigset_t oldmask)
+void child_work(int n, sigset_t oldmask, int ready_fd, trigger_t *trigger, long *delivered)
 {
     srand(time(NULL) * getpid());
     // Generate a random size for buffer (between 10KB and 100KB)
-    int s = (10 + rand() % (100 - 10 + 1))*1024;
+    size_t s = (10 + rand() % (100 - 10 + 1))*1024;
     int out;
-    ssize_t count;
-    char *buf = malloc(s);
-    if (!buf)
+    char *buf;
+    if (direct)
+    {
+        // O_DIRECT transfers whole aligned blocks from aligned memory
+        s = (s + DIRECT_ALIGN - 1) / DIRECT_ALIGN * DIRECT_ALIGN;
+        if (posix_memalign((void **)&buf, DIRECT_ALIGN, s))
+            ERR("posix_memalign");
+    }
+    else if (!(buf = malloc(s)))
         ERR("malloc");
     memset(buf, n + 48, s);
 
@@ -84,78 +279,438 @@ void child_work(int n, sigset_t oldmask)
     char name[50];
     snprintf(name, sizeof(name), "%d.txt", pid);
 
-     // Open file for writing
-    if ((out = TEMP_FAILURE_RETRY(open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0777))) < 0)
+     // Open file for writing; the batched writer keeps its own offset, which O_APPEND would ignore
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | (batched ? 0 : O_APPEND) | (direct ? O_DIRECT : 0);
+    if ((out = TEMP_FAILURE_RETRY(open(name, flags, 0777))) < 0)
        ERR("open");
-    
-    // Wait for SIGUSR1 signal to write data
-    while (1) {
-        while (last_signal != SIGUSR1)
-            sigsuspend(&oldmask);
-        last_signal = 0;
-        if ((count = bulk_write(out, buf, s)) < 0)
-            ERR("read");
+
+    // Closing the write end tells the parent this child is ready for triggers
+    if (TEMP_FAILURE_RETRY(close(ready_fd)))
+        ERR("close");
+
+    writer_stats_t stats = {0};
+    off_t offset = 0, reserved = 0, previous = 0;
+    uint32_t served = 0;
+
+    // Write a block per trigger until the parent ends the run; all triggers pending are taken at once
+    for (;;) {
+        struct timespec since;
+        long count = signals ? take_signal_triggers(&oldmask, &since) : take_counter_triggers(trigger, &served, &since);
+        if (count == 0)
+            break;
+        write_batch(out, buf, s, count, &offset, &reserved, &previous, &stats);
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long latency = elapsed_ns(&since, &now);
+        stats.latency_ns += latency;
+        INSTR_VALUE("pm_trigger_latency_ns", latency);
+        if (latency > stats.max_latency_ns)
+            stats.max_latency_ns = latency;
+        stats.batches++;
+        INSTR_TICK();
     }
 
+    *delivered = stats.blocks;
+
+    if (sync_range && offset > previous &&
+        sync_file_range(out, previous, offset - previous,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER))
+        ERR("sync_file_range");
+    // Space reserved beyond the data is released
+    if (batched && reserved > offset && TEMP_FAILURE_RETRY(ftruncate(out, offset)))
+        ERR("ftruncate");
     if (TEMP_FAILURE_RETRY(close(out)))
         ERR("close");
     free(buf);
+
+    printf("%d: %ld blocks of %zu KB in %ld writes, %.1f MB/s while writing, "
+           "trigger-to-disk latency avg %.1f us max %.1f us\n",
+           pid, stats.blocks, s / 1024, stats.writes,
+           stats.write_ns ? stats.bytes * 1e3 / stats.write_ns : 0.0,
+           stats.batches ? stats.latency_ns / 1e3 / stats.batches : 0.0, stats.max_latency_ns / 1e3);
 }
 
 // Function to display usage instructions
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s 0<n\n", name);
-    ERR("usage");
+    fprintf(stderr, "USAGE: %s [-k] [-b] [-d] [-s] [-p period_us] [-T duration_ms] [-m fork|vfork|spawn] [-c] "
+                    "[-n children] n...\n", name);
+    fprintf(stderr, "  0 <= n <= 9, one child per n, or -n children taking the digits in turn\n");
+    fprintf(stderr, "  -k  trigger with SIGUSR1 instead of the shared counter\n");
+    fprintf(stderr, "  -b  batched writer: coalesce pending blocks into pwritev calls\n");
+    fprintf(stderr, "  -d  O_DIRECT aligned writes (implies -b)\n");
+    fprintf(stderr, "  -s  sync_file_range write-back control (implies -b)\n");
+    fprintf(stderr, "  -m  how children are started (default fork)\n");
+    fprintf(stderr, "  -c  pin children to CPUs, spread across NUMA nodes\n");
     exit(EXIT_FAILURE);
 }
 
+// Function to run a child started with vfork or posix_spawn, which execs this program with
+// --child n index trigger_fd ready_fd flags
+void child_main(char **argv)
+{
+    int n = atoi(argv[2]), index = atoi(argv[3]), trigger_fd = atoi(argv[4]), ready_fd = atoi(argv[5]);
+    int flags = atoi(argv[6]);
+    signals = flags & 1;
+    batched = (flags >> 1) & 1;
+    direct = (flags >> 2) & 1;
+    sync_range = (flags >> 3) & 1;
+
+    // The trigger channel is a memfd inherited across exec instead of an inherited mapping
+    struct stat st;
+    if (fstat(trigger_fd, &st))
+        ERR("fstat");
+    trigger_t *trigger = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, trigger_fd, 0);
+    if (trigger == MAP_FAILED)
+        ERR("mmap");
+    if (TEMP_FAILURE_RETRY(close(trigger_fd)))
+        ERR("close");
+
+    // The blocked signal mask survives exec, the handlers do not
+    sigset_t oldmask;
+    sethandler(sig_handler, SIGUSR1);
+    sethandler(sig_handler, SIGUSR2);
+    sigprocmask(SIG_SETMASK, NULL, &oldmask);
+    sigdelset(&oldmask, SIGUSR1);
+    sigdelset(&oldmask, SIGUSR2);
+    child_work(n, oldmask, ready_fd, trigger, &trigger->delivered[index]);
+    exit(EXIT_SUCCESS);
+}
+
+// Function comparing CPUs by their rank within their NUMA node, then by node
+int compare_rank(const void *a, const void *b)
+{
+    const int *x = a, *y = b;
+    return x[0] != y[0] ? x[0] - y[0] : x[1] - y[1];
+}
+
+// Function to list the CPUs this process may run on, ordered so that consecutive children land on
+// different NUMA nodes; returns the number of CPUs
+int pinning_order(int *cpus)
+{
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed))
+        ERR("sched_getaffinity");
+    static int node_of[CPU_SETSIZE];
+    for (int node = 0; node < MAX_NODES; node++)
+    {
+        char path[64];
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        FILE *f = fopen(path, "r");
+        if (!f)
+            continue;
+        // A list of ranges like 0-3,8-11
+        int first, last, c;
+        while (fscanf(f, "%d", &first) == 1)
+        {
+            last = first;
+            if ((c = fgetc(f)) == '-' && fscanf(f, "%d", &last) == 1)
+                c = fgetc(f);
+            for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+                node_of[cpu] = node;
+            if (c != ',')
+                break;
+        }
+        fclose(f);
+    }
+
+    static int ranked[CPU_SETSIZE][3];
+    int count = 0, rank[MAX_NODES] = {0};
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        ranked[count][0] = rank[node_of[cpu]]++;
+        ranked[count][1] = node_of[cpu];
+        ranked[count++][2] = cpu;
+    }
+    qsort(ranked, count, sizeof(ranked[0]), compare_rank);
+    for (int i = 0; i < count; i++)
+        cpus[i] = ranked[i][2];
+    return count;
+}
+
+// Function to start one child in the chosen way, returns its pid
+pid_t spawn_child(int mode, int n, int index, int trigger_fd, trigger_t *trigger, int ready[2], sigset_t oldmask)
+{
+    pid_t pid;
+    if (mode == SPAWN_FORK)
+    {
+        if ((pid = fork()) < 0)
+            ERR("Fork:");
+        if (!pid)
+        {
+            sethandler(sig_handler, SIGUSR1);
+            sethandler(sig_handler, SIGUSR2);
+            if (TEMP_FAILURE_RETRY(close(ready[0])))
+                ERR("close");
+            // The mapping was inherited with the fork, the descriptor is no longer needed
+            if (TEMP_FAILURE_RETRY(close(trigger_fd)))
+                ERR("close");
+            child_work(n, oldmask, ready[1], trigger, &trigger->delivered[index]);
+            exit(EXIT_SUCCESS);
+        }
+        return pid;
+    }
+
+    // The exec'd children share no page tables with the parent, so their start does not copy them
+    char args[5][16];
+    snprintf(args[0], sizeof(args[0]), "%d", n);
+    snprintf(args[1], sizeof(args[1]), "%d", index);
+    snprintf(args[2], sizeof(args[2]), "%d", trigger_fd);
+    snprintf(args[3], sizeof(args[3]), "%d", ready[1]);
+    snprintf(args[4], sizeof(args[4]), "%d", signals | batched << 1 | direct << 2 | sync_range << 3);
+    char *child_argv[] = {"process_manager", "--child", args[0], args[1], args[2], args[3], args[4], NULL};
+    if (mode == SPAWN_VFORK)
+    {
+        // The child borrows the parent's memory until execv, so it may do nothing else
+        if ((pid = vfork()) < 0)
+            ERR("vfork");
+        if (!pid)
+        {
+            execv("/proc/self/exe", child_argv);
+            _exit(127);
+        }
+        return pid;
+    }
+    if ((errno = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, child_argv, environ)) != 0)
+        ERR("posix_spawn");
+    return pid;
+}
+
+// Function to reap all children through their pidfds, returns how many did not exit successfully
+int reap_children(int epfd, int children)
+{
+    struct epoll_event events[64];
+    int failed = 0;
+    while (children > 0)
+    {
+        int ready = epoll_wait(epfd, events, 64, -1);
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("epoll_wait");
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            int pidfd = events[i].data.fd;
+            siginfo_t info;
+            if (TEMP_FAILURE_RETRY(waitid(P_PIDFD, pidfd, &info, WEXITED)))
+                ERR("waitid");
+            if (info.si_code != CLD_EXITED || info.si_status != EXIT_SUCCESS)
+                failed++;
+            // Forked children still hold copies of this pidfd, which would keep it registered after close
+            if (epoll_ctl(epfd, EPOLL_CTL_DEL, pidfd, NULL))
+                ERR("epoll_ctl");
+            if (TEMP_FAILURE_RETRY(close(pidfd)))
+                ERR("close");
+            children--;
+        }
+    }
+    return failed;
+}
+
 int main(int argc, char **argv)
 {
-    int n;
-    if (argc < 2)
+    if (argc == 7 && strcmp(argv[1], "--child") == 0)
+        child_main(argv);
+
+    int c, mode = SPAWN_FORK, pin = 0, children = 0;
+    long period_us = DEFAULT_PERIOD_US, duration_ms = DEFAULT_DURATION_MS;
+    while ((c = getopt(argc, argv, "kbdsp:T:m:cn:")) != -1)
+    {
+        switch (c)
+        {
+        case 'm':
+            if (strcmp(optarg, "fork") == 0)
+                mode = SPAWN_FORK;
+            else if (strcmp(optarg, "vfork") == 0)
+                mode = SPAWN_VFORK;
+            else if (strcmp(optarg, "spawn") == 0)
+                mode = SPAWN_POSIX;
+            else
+                usage(argv[0]);
+            break;
+        case 'c':
+            pin = 1;
+            break;
+        case 'n':
+            if ((children = atoi(optarg)) < 1)
+                usage(argv[0]);
+            break;
+        case 'k':
+            signals = 1;
+            break;
+        case 'b':
+            batched = 1;
+            break;
+        case 'd':
+            direct = batched = 1;
+            break;
+        case 's':
+            sync_range = batched = 1;
+            break;
+        case 'p':
+            period_us = atol(optarg);
+            break;
+        case 'T':
+            duration_ms = atol(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind >= argc || period_us < 0 || duration_ms < 1)
         usage(argv[0]);
-    pid_t s;
+    int digits = argc - optind;
+    for (int i = optind; i < argc; i++)
+        if (atoi(argv[i]) < 0 || atoi(argv[i]) > 9)
+            usage(argv[0]);
+    if (!children)
+        children = digits;
+
+    // Every child costs the parent a pidfd
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
 
     // Set signal handlers
-    sethandler(sigchld_handler, SIGCHLD);
     sethandler(SIG_IGN, SIGUSR1);
+    sethandler(SIG_IGN, SIGUSR2);
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIGUSR2);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
+    // The trigger channel lives in a memfd, so children that exec this program again can map it too
+    size_t trigger_size = sizeof(trigger_t) + children * sizeof(long);
+    int trigger_fd = memfd_create("triggers", 0);
+    if (trigger_fd < 0)
+        ERR("memfd_create");
+    if (ftruncate(trigger_fd, trigger_size))
+        ERR("ftruncate");
+    trigger_t *trigger = mmap(NULL, trigger_size, PROT_READ | PROT_WRITE, MAP_SHARED, trigger_fd, 0);
+    if (trigger == MAP_FAILED)
+        ERR("mmap");
+
+    // Only the write end of the ready pipe is inherited across exec
+    int ready[2];
+    if (pipe2(ready, O_CLOEXEC) || fcntl(ready[1], F_SETFD, 0))
+        ERR("pipe");
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd < 0)
+        ERR("epoll_create1");
+    int *cpus = NULL, cpu_count = 0;
+    if (pin)
+    {
+        if (!(cpus = malloc(CPU_SETSIZE * sizeof(int))))
+            ERR("malloc");
+        cpu_count = pinning_order(cpus);
+    }
+
      // Create child processes based on provided arguments
-    for (int i = 1; i < argc; i++)
+    struct timespec spawn_start, spawn_end, ready_end;
+    clock_gettime(CLOCK_MONOTONIC, &spawn_start);
+    for (int i = 0; i < children; i++)
     {
-        n = atoi(argv[i]);
-        if (n < 0 || n > 9)
-            usage(argv[0]);
-        if ((s = fork()) < 0)
-            ERR("Fork:");
-        if (!s)
-        {   
-            sethandler(sig_handler, SIGUSR1);
-            child_work(n, oldmask);
-            exit(EXIT_SUCCESS);
+        INSTR_TIMER_START(child_start);
+        pid_t pid = spawn_child(mode, atoi(argv[optind + i % digits]), i, trigger_fd, trigger, ready, oldmask);
+        if (pin)
+        {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i % cpu_count], &set);
+            if (sched_setaffinity(pid, sizeof(set), &set))
+                ERR("sched_setaffinity");
         }
+        // A pidfd per child replaces SIGCHLD; it becomes readable when the child exits
+        int pidfd = syscall(SYS_pidfd_open, pid, 0);
+        if (pidfd < 0)
+            ERR("pidfd_open");
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = pidfd};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, pidfd, &event))
+            ERR("epoll_ctl");
+        INSTR_TIMER_STOP("pm_spawn", child_start);
     }
+    clock_gettime(CLOCK_MONOTONIC, &spawn_end);
+    free(cpus);
+    if (TEMP_FAILURE_RETRY(close(trigger_fd)))
+        ERR("close");
 
-    // Allow child processes to initialize
-    sleep(1);
-    struct timespec t = {15, 20000};
+    // Wait until every child has opened its file and closed its end of the ready pipe
+    if (TEMP_FAILURE_RETRY(close(ready[1])))
+        ERR("close");
+    char byte;
+    while (TEMP_FAILURE_RETRY(read(ready[0], &byte, 1)) > 0)
+        ;
+    if (TEMP_FAILURE_RETRY(close(ready[0])))
+        ERR("close");
+    clock_gettime(CLOCK_MONOTONIC, &ready_end);
+    static const char *mode_names[] = {"fork", "vfork", "posix_spawn"};
+    printf("Parent: spawned %d children with %s in %.3f ms (%.3f ms per 1000), all ready after %.3f ms\n", children,
+           mode_names[mode], elapsed_ns(&spawn_start, &spawn_end) / 1e6,
+           elapsed_ns(&spawn_start, &spawn_end) / 1e3 / children, elapsed_ns(&spawn_start, &ready_end) / 1e6);
 
-    // Send SIGUSR1 signal three times to all processes
-    for(int i = 0; i < 3; i++)
+    // Trigger all children every period for the duration of the run, with a period of 0 as fast as possible
+    struct timespec t = {period_us / 1000000, period_us % 1000000 * 1000};
+    long triggers = 0;
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do
     {
-        nanosleep(&t, NULL);
-        if (kill(0, SIGUSR1) < 0)
-        ERR("kill");
+        if (signals)
+        {
+            if (kill(0, SIGUSR1) < 0)
+                ERR("kill");
+        }
+        else
+        {
+            // The send time is stored before seq makes the trigger visible
+            clock_gettime(CLOCK_MONOTONIC, &trigger->sent_at[triggers % TRIGGER_RING]);
+            __atomic_add_fetch(&trigger->seq, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&trigger->waiters, __ATOMIC_SEQ_CST))
+                futex_wake_all(&trigger->seq);
+        }
+        triggers++;
+        INSTR_COUNT("pm_triggers", 1);
+        INSTR_TICK();
+        if (period_us)
+            nanosleep(&t, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_ns(&start, &now) < duration_ms * 1000000LL);
+
+    // Tell the children to write what is pending, report and exit
+    if (signals)
+    {
+        if (kill(0, SIGUSR2) < 0)
+            ERR("kill");
     }
-    
+    else
+    {
+        __atomic_store_n(&trigger->done, 1, __ATOMIC_SEQ_CST);
+        futex_wake_all(&trigger->seq);
+    }
+
     // Wait for all child processes to terminate
-    while (wait(NULL) > 0)
-            ;
+    int failed = reap_children(epfd, children);
+    if (TEMP_FAILURE_RETRY(close(epfd)))
+        ERR("close");
+    if (failed)
+        printf("Parent: %d children failed\n", failed);
+    long delivered = 0;
+    for (int i = 0; i < children; i++)
+        delivered += trigger->delivered[i];
+    printf("Parent: %ld triggers sent in %.3f s (%.0f/s), %ld delivered, %ld missed\n", triggers,
+           elapsed_ns(&start, &now) / 1e9, triggers * 1e9 / elapsed_ns(&start, &now), delivered,
+           triggers * children - delivered);
+    if (munmap(trigger, trigger_size))
+        ERR("munmap");
     return EXIT_SUCCESS;
 }
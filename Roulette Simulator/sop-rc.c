@@ -1,115 +1,725 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <time.h>
 
+#include "../Instrumentation/sop-instr.h"
+
+#define ERR(source) \
+    (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
+
 #define MIN_BET 1               // Minimum bet amount
 #define MAX_NUMBER 36           // Maximum number on the roulette wheel
 #define EXIT_PROBABILITY 10     // Probability (in %) that a player exits the game
+#define ROUND_TIMEOUT_MS 1000   // Default time the dealer waits for the bets of a round
+#define BENCH_MONEY 1000000000  // Starting money of benchmark players, who always bet MIN_BET and never leave
+#define TABLE_PLAYERS 8         // Players sharing one wheel in the simulation engine
+#define TABLE_LIMIT 1000000000  // Largest stake the simulation engine accepts
+#define MAX_THREADS 64          // Largest number of simulation threads
+#define EXIT_THRESHOLD ((uint32_t)(EXIT_PROBABILITY * 4294967296.0 / 100)) // EXIT_PROBABILITY as a 32-bit draw
+
+// Philox4x32-10 constants
+#define PHILOX_M0 0xD2511F53u
+#define PHILOX_M1 0xCD9E8D57u
+#define PHILOX_W0 0x9E3779B9u
+#define PHILOX_W1 0xBB67AE85u
+
+#define FRAME_BET 1             // Player to dealer: stake and number for a round
+#define FRAME_RESULT 2          // Dealer to player: lucky number and the stake the dealer accepted
+
+// Fixed-size frame used in both directions. Every frame is sent with a single write; writes of at most
+// PIPE_BUF bytes are atomic, so a frame is never split or interleaved and one read returns it whole
+typedef struct {
+    int32_t type;   // FRAME_BET or FRAME_RESULT
+    int32_t round;  // Round the frame belongs to
+    int32_t amount; // Bet: stake; result: stake accepted for this round, 0 if the bet missed the round
+    int32_t number; // Bet: number bet on; result: lucky number
+} frame_t;
+
+_Static_assert(sizeof(frame_t) <= PIPE_BUF, "frames must fit in one atomic pipe write");
+
+// Bet slot of one player in the shared table, on its own cache line so players never share a line
+typedef struct {
+    int32_t round;          // Round the bet is for, stored last by the player
+    int32_t amount;         // Stake
+    int32_t number;         // Number bet on
+    int32_t left;           // Set when the player left the table
+    int32_t accepted_round; // Last round whose bet the dealer accepted, stored last by the dealer
+    int32_t lucky_number;   // Lucky number of accepted_round
+} __attribute__((aligned(64))) bet_slot_t;
+
+// Table shared by the dealer and all players in the shared memory transport. The round descriptor is a
+// futex word the players sleep on and the dealer wakes all at once; arrivals is the futex word the dealer
+// sleeps on while the bets come in
+typedef struct {
+    __attribute__((aligned(64))) uint32_t round; // Last round whose results are published
+    uint32_t closed;                              // Set when the dealer closes the table
+    __attribute__((aligned(64))) uint32_t arrivals; // Bets and departures so far
+    uint32_t wake_at;                              // Value of arrivals at which a player wakes the dealer
+    bet_slot_t slots[];
+} table_t;
+
+// Players of one simulation thread in struct-of-arrays layout. Players that left or went broke are
+// compacted out after every round, so the arrays stay dense and the first count entries are the players
+// still at the tables
+typedef struct {
+    int64_t *money;   // Money of each player
+    int64_t *bet;     // Stake of the current round, 0 if the player leaves
+    uint32_t *number; // Number bet on in the current round
+    uint32_t *id;     // Player number, selects the player's random stream and table
+    uint32_t first;   // First player of the shard
+    uint32_t players; // Players in the shard
+    uint32_t count;   // Players still at the tables
+    int64_t start_money;
+    long max_rounds;
+    uint32_t key[2];  // Philox key shared by all streams
+    // Results of the shard
+    long rounds;
+    long bets, wins;
+    double wagered, paid;
+    long broke, saved;
+    double saved_money;
+} __attribute__((aligned(64))) shard_t;
+
+int bench_rounds = 0; // Rounds to play in benchmark mode, 0 in a normal game
+double rounds_seconds; // Time the dealer spent in the rounds of the last game, without forking and reaping
+
+// Function to send one frame, returns 0 on success and -1 if the other end is gone
+int send_frame(int fd, frame_t *frame) {
+    ssize_t c = TEMP_FAILURE_RETRY(write(fd, frame, sizeof(frame_t)));
+    if (c < 0) {
+        if (errno == EPIPE)
+            return -1;
+        ERR("write");
+    }
+    return 0;
+}
+
+// Function to receive one frame, returns 0 on success and -1 at end of file
+int recv_frame(int fd, frame_t *frame) {
+    ssize_t c = TEMP_FAILURE_RETRY(read(fd, frame, sizeof(frame_t)));
+    if (c < 0)
+        ERR("read");
+    if (c == 0)
+        return -1;
+    if (c != sizeof(frame_t)) {
+        fprintf(stderr, "short frame of %zd bytes\n", c);
+        exit(EXIT_FAILURE);
+    }
+    return 0;
+}
+
+// Function to print a game message, silent in benchmark mode
+void say(const char *format, ...) {
+    if (bench_rounds)
+        return;
+    va_list args;
+    va_start(args, format);
+    vprintf(format, args);
+    va_end(args);
+}
+
+// Function to wait on a futex word shared between processes while it holds the expected value
+void futex_wait(uint32_t *word, uint32_t expected, long long timeout_ms) {
+    struct timespec t = {timeout_ms / 1000, timeout_ms % 1000 * 1000000};
+    if (syscall(SYS_futex, word, FUTEX_WAIT, expected, timeout_ms < 0 ? NULL : &t, NULL, 0) < 0 &&
+        errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT)
+        ERR("futex");
+}
+
+// Function to wake up to count waiters on a futex word shared between processes
+void futex_wake(uint32_t *word, int count) {
+    if (syscall(SYS_futex, word, FUTEX_WAKE, count, NULL, NULL, 0) < 0)
+        ERR("futex");
+}
+
+// Function returning milliseconds on the monotonic clock
+long long now_ms(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000LL + t.tv_nsec / 1000000;
+}
+
+// Function deciding the player's next move, returns 0 if the player leaves with its money
+int choose_bet(int money, int round, frame_t *bet) {
+    // 10% chance that the player exits the game with remaining money
+    if (!bench_rounds && rand() % 100 < EXIT_PROBABILITY) {
+        say("%d: I saved %d\n", getpid(), money);
+        return 0;
+    }
+    bet->type = FRAME_BET;
+    bet->round = round;
+    bet->amount = bench_rounds ? MIN_BET : (rand() % money) + MIN_BET; // Random bet (between 1 and the player's current money)
+    bet->number = rand() % (MAX_NUMBER + 1);    // Random number to bet on (between 0 and 36)
+    return 1;
+}
+
+// Function to settle a bet against the result of its round, returns the money the player gets back
+int settle(frame_t *bet, int accepted, int lucky_number) {
+    if (!accepted) {
+        // The bet arrived after the round was closed and the dealer dropped it
+        say("%d: I was too late for round %d.\n", getpid(), bet->round);
+        return bet->amount;
+    }
+    if (lucky_number == bet->number) {
+        int winnings = bet->amount * 35;    // Calculate the winnings if the player wins
+        say("%d: I won %d.\n", getpid(), winnings);
+        return winnings;
+    }
+    return 0;
+}
 
 // Function that simulates the player's behavior
-void player_process(int id, int start_money, int write_fd, int read_fd) {
+void player_process(int start_money, int write_fd, int read_fd) {
     int money = start_money;     // Player's starting money
+    int round = 1;               // Round the next bet is for
     srand(time(NULL) ^ getpid()); // Seed random number generator based on the current time and process ID
-    printf("%d: I have %d and I'm going to play roulette.\n", getpid(), money);
+    say("%d: I have %d and I'm going to play roulette.\n", getpid(), money);
 
-    while (money > 0) {  // Continue playing as long as the player has money
-        // 10% chance that the player exits the game with remaining money
-        if (rand() % 100 < EXIT_PROBABILITY) {
-            printf("%d: I saved %d\n", getpid(), money);
+    frame_t bet;
+    while (money > 0 && choose_bet(money, round, &bet)) {  // Continue playing as long as the player has money
+        // Send the bet and chosen number to the dealer (krupier)
+        if (send_frame(write_fd, &bet) < 0)
             exit(0);
-        }
+        money -= bet.amount;  // Deduct the bet amount from player's money
 
-        int bet = (rand() % money) + MIN_BET;   // Random bet (between 1 and the player's current money)
-        int number = rand() % (MAX_NUMBER + 1); // Random number to bet on (between 0 and 36)
-        
-        // Send the bet and chosen number to the dealer (krupier)
-        dprintf(write_fd, "%d %d\n", bet, number);
-        money -= bet;  // Deduct the bet amount from player's money
-        
-        int result;
         // Read the result of the spin from the dealer
-        if (read(read_fd, &result, sizeof(int)) > 0 && result == number) {
-            int winnings = bet * 35;    // Calculate the winnings if the player wins
-            money += winnings;          // Add winnings to the player's money
-            printf("%d: I won %d.\n", getpid(), winnings);
+        frame_t result;
+        if (recv_frame(read_fd, &result) < 0)
+            exit(0);
+        money += settle(&bet, result.amount != 0, result.number);
+        if (result.amount == 0) {
+            // Results of rounds missed meanwhile are queued, skip them to bet on the current round
+            struct pollfd pfd = {read_fd, POLLIN, 0};
+            while (poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN) && recv_frame(read_fd, &result) == 0)
+                ;
         }
+        round = result.round + 1;
     }
-    
+
     // If the player runs out of money, exit
-    printf("%d: I'm broke.\n", getpid());
+    if (money <= 0)
+        say("%d: I'm broke.\n", getpid());
     exit(0);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc != 3) {  // Check if the correct number of arguments is passed
-        fprintf(stderr, "Usage: %s <number_of_players> <start_money>\n", argv[0]);
-        return 1;
+// Function to count an arrival at the shared table and wake the dealer once all bets it waits for are in
+void shm_arrive(table_t *table) {
+    uint32_t arrivals = __atomic_add_fetch(&table->arrivals, 1, __ATOMIC_ACQ_REL);
+    if (arrivals >= __atomic_load_n(&table->wake_at, __ATOMIC_ACQUIRE))
+        futex_wake(&table->arrivals, 1);
+}
+
+// Function that simulates the player's behavior at the shared table
+void shm_player_process(int start_money, table_t *table, bet_slot_t *slot) {
+    int money = start_money;     // Player's starting money
+    int round = 1;               // Round the next bet is for
+    srand(time(NULL) ^ getpid()); // Seed random number generator based on the current time and process ID
+    say("%d: I have %d and I'm going to play roulette.\n", getpid(), money);
+
+    frame_t bet;
+    while (money > 0 && choose_bet(money, round, &bet)) {
+        // Place the bet in the slot; the round is stored last, so the dealer never sees half a bet
+        slot->amount = bet.amount;
+        slot->number = bet.number;
+        __atomic_store_n(&slot->round, round, __ATOMIC_RELEASE);
+        shm_arrive(table);
+        money -= bet.amount;
+
+        // Sleep until the dealer publishes the round; a single wake-up reaches every player
+        uint32_t published;
+        while ((published = __atomic_load_n(&table->round, __ATOMIC_ACQUIRE)) < (uint32_t)round) {
+            if (__atomic_load_n(&table->closed, __ATOMIC_ACQUIRE))
+                exit(0);
+            futex_wait(&table->round, published, -1);
+        }
+        int accepted = __atomic_load_n(&slot->accepted_round, __ATOMIC_ACQUIRE) == round;
+        money += settle(&bet, accepted, slot->lucky_number);
+        round = published + 1;  // A late player skips the rounds it missed
     }
-    
-    int num_players = atoi(argv[1]);   // Number of players (N)
-    int start_money = atoi(argv[2]);   // Starting money (M)
-    
-    // Validate the input values
-    if (num_players < 1 || start_money < 100) {
-        fprintf(stderr, "Invalid input: N >= 1, M >= 100\n");
-        return 1;
+
+    if (money <= 0)
+        say("%d: I'm broke.\n", getpid());
+    __atomic_store_n(&slot->left, 1, __ATOMIC_RELEASE);
+    shm_arrive(table);
+    exit(0);
+}
+
+// Function to collect the bets of one round from all active players as they arrive, until every active
+// player has bet or left or the timeout expires. Returns the number of accepted bets
+int collect_bets(int num_players, int *bet_fds, pid_t *pids, int round, int timeout_ms, frame_t *bets,
+                 struct pollfd *pfds, int *index) {
+    int accepted = 0;
+    long long deadline = now_ms() + timeout_ms;
+    for (int i = 0; i < num_players; i++)
+        bets[i].amount = 0;
+
+    for (;;) {
+        // Wait only on players that neither bet nor left yet
+        int n = 0;
+        for (int i = 0; i < num_players; i++) {
+            if (bet_fds[i] >= 0 && bets[i].amount == 0) {
+                pfds[n].fd = bet_fds[i];
+                pfds[n].events = POLLIN;
+                index[n++] = i;
+            }
+        }
+        long long left = deadline - now_ms();
+        if (n == 0 || left <= 0)
+            break;
+        int ready = poll(pfds, n, left);
+        if (ready < 0) {
+            if (errno == EINTR)
+                continue;
+            ERR("poll");
+        }
+        if (ready == 0)
+            break;
+        for (int k = 0; k < n; k++) {
+            if (!(pfds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                continue;
+            int i = index[k];
+            frame_t frame;
+            if (recv_frame(bet_fds[i], &frame) < 0) {
+                // The player left the table
+                if (close(bet_fds[i]))
+                    ERR("close");
+                bet_fds[i] = -1;
+                continue;
+            }
+            if (frame.type != FRAME_BET || frame.round != round || frame.amount <= 0)
+                continue;  // Stale bet of a round that was already closed
+            bets[i] = frame;
+            say("Dealer: %d placed %d on %d\n", pids[i], frame.amount, frame.number);
+            accepted++;
+        }
     }
-    
+    return accepted;
+}
+
+// Function to play a game over pipes, returns the number of rounds played
+int play_pipes(int num_players, int start_money, int timeout_ms) {
     // Create pipes for communication between players and the dealer
     int pipes[num_players][2], result_pipes[num_players][2];
     pid_t pids[num_players];
-    
+    int bet_fds[num_players];
+    frame_t bets[num_players];
+    struct pollfd pfds[num_players];
+    int index[num_players];
+
+    fflush(stdout);  // Buffered output must not be inherited and printed again by every player
+
     // Create player processes
     for (int i = 0; i < num_players; i++) {
-        pipe(pipes[i]);           // Pipe for player to send bet data
-        pipe(result_pipes[i]);    // Pipe for dealer to send result back to player
-        
-        if ((pids[i] = fork()) == 0) {  // Create a child process for each player
+        if (pipe(pipes[i]) || pipe(result_pipes[i]))  // Pipes for bets and for results
+            ERR("pipe");
+
+        if ((pids[i] = fork()) < 0)
+            ERR("fork");
+        if (pids[i] == 0) {  // Create a child process for each player
+            // Close the dealer ends of earlier players inherited from the dealer
+            for (int j = 0; j < i; j++) {
+                close(pipes[j][0]);
+                close(result_pipes[j][1]);
+            }
             close(pipes[i][0]);   // Close unused read end of pipe
             close(result_pipes[i][1]); // Close unused write end of result pipe
-            player_process(i, start_money, pipes[i][1], result_pipes[i][0]);  // Call player process function
+            player_process(start_money, pipes[i][1], result_pipes[i][0]);  // Call player process function
         }
-        
+
         close(pipes[i][1]);      // Close unused write end of pipe
         close(result_pipes[i][0]);  // Close unused read end of result pipe
+        bet_fds[i] = pipes[i][0];
     }
-    
-    srand(time(NULL));  // Seed the random number generator for the dealer
-    
-    while (1) {
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int round;
+    for (round = 1; !bench_rounds || round <= bench_rounds; round++) {
+        INSTR_SCOPE("rc_pipe_round");
+        // Dealer receives bets from players, a player missing the timeout sits the round out
+        collect_bets(num_players, bet_fds, pids, round, timeout_ms, bets, pfds, index);
+
+        // If no active players, the casino always wins
         int active_players = 0;  // Counter for active players (those still in the game)
-        
-        // Dealer receives bets from players
+        for (int i = 0; i < num_players; i++)
+            active_players += bet_fds[i] >= 0;
+        INSTR_COUNT("rc_pipe_seats", active_players);
+        if (active_players == 0) {
+            say("Dealer: Casino always wins\n");
+            break;
+        }
+
+        int lucky_number = rand() % (MAX_NUMBER + 1);  // Randomly select a lucky number
+        say("Dealer: %d is the lucky number.\n", lucky_number);
+
+        // Send the lucky number to all players, with the stake accepted from each
         for (int i = 0; i < num_players; i++) {
-            int bet, number;
-            // Read bet and number chosen by the player
-            if (read(pipes[i][0], &bet, sizeof(int)) > 0 && read(pipes[i][0], &number, sizeof(int)) > 0) {
-                printf("Dealer: %d placed %d on %d\n", pids[i], bet, number);
-                active_players++;  // Increment active players count
+            if (bet_fds[i] < 0)
+                continue;
+            if (bets[i].amount == 0)
+                say("Dealer: %d missed round %d\n", pids[i], round);
+            frame_t result = {FRAME_RESULT, round, bets[i].amount, lucky_number};
+            if (send_frame(result_pipes[i][1], &result) < 0) {
+                close(bet_fds[i]);
+                bet_fds[i] = -1;
             }
         }
-        
-        // If no active players, the casino always wins
+        INSTR_TICK();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rounds_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    // Wait for all players to finish; closing the result pipes ends the game of players still at the table
+    for (int i = 0; i < num_players; i++) {
+        if (bet_fds[i] >= 0)
+            close(bet_fds[i]);
+        close(result_pipes[i][1]);
+    }
+    for (int i = 0; i < num_players; i++)
+        wait(NULL);
+    return round - 1;
+}
+
+// Function to collect the bets of one round from the shared table until every active player has bet or
+// left or the timeout expires; players that left are cleared from active
+void shm_collect_bets(table_t *table, int num_players, int *active, int round, int timeout_ms) {
+    long long deadline = now_ms() + timeout_ms;
+    for (;;) {
+        uint32_t seen = __atomic_load_n(&table->arrivals, __ATOMIC_ACQUIRE);
+        int missing = 0;
+        for (int i = 0; i < num_players; i++) {
+            if (!active[i])
+                continue;
+            if (__atomic_load_n(&table->slots[i].left, __ATOMIC_ACQUIRE))
+                active[i] = 0;
+            else if (__atomic_load_n(&table->slots[i].round, __ATOMIC_ACQUIRE) != round)
+                missing++;
+        }
+        long long left = deadline - now_ms();
+        if (missing == 0 || left <= 0)
+            break;
+        // Arrivals after the scan change the futex word, so the wait below returns at once and we rescan
+        __atomic_store_n(&table->wake_at, seen + missing, __ATOMIC_RELEASE);
+        futex_wait(&table->arrivals, seen, left);
+    }
+    // Arrivals for the next round must not wake the dealer before it is waiting for them
+    __atomic_store_n(&table->wake_at, UINT32_MAX, __ATOMIC_RELEASE);
+}
+
+// Function to play a game over shared memory, returns the number of rounds played
+int play_shm(int num_players, int start_money, int timeout_ms) {
+    size_t size = sizeof(table_t) + num_players * sizeof(bet_slot_t);
+    table_t *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        ERR("mmap");
+    table->wake_at = UINT32_MAX;
+    pid_t pids[num_players];
+    int active[num_players];
+
+    fflush(stdout);  // Buffered output must not be inherited and printed again by every player
+
+    // Create player processes, all of them share the table mapped before the fork
+    for (int i = 0; i < num_players; i++) {
+        if ((pids[i] = fork()) < 0)
+            ERR("fork");
+        if (pids[i] == 0)
+            shm_player_process(start_money, table, &table->slots[i]);
+        active[i] = 1;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int round;
+    for (round = 1; !bench_rounds || round <= bench_rounds; round++) {
+        INSTR_SCOPE("rc_shm_round");
+        shm_collect_bets(table, num_players, active, round, timeout_ms);
+
+        int active_players = 0;
+        for (int i = 0; i < num_players; i++)
+            active_players += active[i];
+        INSTR_COUNT("rc_shm_seats", active_players);
         if (active_players == 0) {
-            printf("Dealer: Casino always wins\n");
+            say("Dealer: Casino always wins\n");
             break;
         }
-        
-        int lucky_number = rand() % (MAX_NUMBER + 1);  // Randomly select a lucky number
-        printf("Dealer: %d is the lucky number.\n", lucky_number);
-        
-        // Send the lucky number to all players
+
+        int lucky_number = rand() % (MAX_NUMBER + 1);
         for (int i = 0; i < num_players; i++) {
-            write(result_pipes[i][1], &lucky_number, sizeof(int));
+            bet_slot_t *slot = &table->slots[i];
+            if (!active[i])
+                continue;
+            if (__atomic_load_n(&slot->round, __ATOMIC_ACQUIRE) != round) {
+                say("Dealer: %d missed round %d\n", pids[i], round);
+                continue;
+            }
+            say("Dealer: %d placed %d on %d\n", pids[i], slot->amount, slot->number);
+            slot->lucky_number = lucky_number;
+            __atomic_store_n(&slot->accepted_round, round, __ATOMIC_RELEASE);
         }
+        say("Dealer: %d is the lucky number.\n", lucky_number);
+
+        // Publish the round: one store and one wake-up for all players instead of a write per player
+        __atomic_store_n(&table->round, round, __ATOMIC_RELEASE);
+        futex_wake(&table->round, INT_MAX);
+        INSTR_TICK();
     }
-    
-    // Wait for all players to finish before exiting
-    for (int i = 0; i < num_players; i++) {
-        wait(NULL); 
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    rounds_seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    __atomic_store_n(&table->closed, 1, __ATOMIC_RELEASE);
+    futex_wake(&table->round, INT_MAX);
+    for (int i = 0; i < num_players; i++)
+        wait(NULL);
+    if (munmap(table, size))
+        ERR("munmap");
+    return round - 1;
+}
+
+// Function to measure rounds per second of both transports for growing numbers of players
+void benchmark(int max_players, int rounds) {
+    // Every pipe player keeps two descriptors open in the dealer
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    bench_rounds = rounds;
+    printf("%8s %14s %14s %8s\n", "players", "pipe rounds/s", "shm rounds/s", "speedup");
+    for (int n = 1;; n = n * 2 > max_players && n < max_players ? max_players : n * 2) {
+        double rate[2];
+        for (int shm = 0; shm < 2; shm++) {
+            // A player that cannot keep up for a whole minute is not a benchmark any more
+            int played = shm ? play_shm(n, BENCH_MONEY, 60000) : play_pipes(n, BENCH_MONEY, 60000);
+            rate[shm] = played / rounds_seconds;
+        }
+        printf("%8d %14.0f %14.0f %7.2fx\n", n, rate[0], rate[1], rate[1] / rate[0]);
+        fflush(stdout);
+        if (n >= max_players)
+            break;
+    }
+}
+
+// Function to compute one Philox4x32-10 block: four 32-bit draws that depend only on the counter and the key
+static inline void philox4x32(uint32_t c[4], uint32_t k0, uint32_t k1) {
+    for (int r = 0; r < 10; r++) {
+        uint64_t p0 = (uint64_t)PHILOX_M0 * c[0];
+        uint64_t p1 = (uint64_t)PHILOX_M1 * c[2];
+        uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+        uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+        c[0] = n0;
+        c[1] = (uint32_t)p1;
+        c[2] = n2;
+        c[3] = (uint32_t)p0;
+        k0 += PHILOX_W0;
+        k1 += PHILOX_W1;
     }
-    return 0;  
+}
+
+// Function to play one round for all players of a shard. Every draw is a function of (player, round), so
+// the loops have no carried state except the sums and the compiler can vectorize them
+void simulate_round(shard_t *shard, uint32_t round) {
+    int64_t *restrict money = shard->money;
+    int64_t *restrict bet = shard->bet;
+    uint32_t *restrict number = shard->number;
+    uint32_t *restrict id = shard->id;
+    uint32_t count = shard->count;
+    uint32_t k0 = shard->key[0], k1 = shard->key[1];
+
+    // Decisions: leave, stake and number, from the player's stream at counter (id, round, 0, 0)
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t c[4] = {id[i], round, 0, 0};
+        philox4x32(c, k0, k1);
+        int64_t limit = money[i] < TABLE_LIMIT ? money[i] : TABLE_LIMIT;
+        int64_t stake = MIN_BET + (int64_t)(((uint64_t)c[1] * (uint64_t)limit) >> 32);
+        bet[i] = c[0] < EXIT_THRESHOLD ? 0 : stake;
+        number[i] = (uint32_t)(((uint64_t)c[2] * (MAX_NUMBER + 1)) >> 32);
+    }
+
+    // Spins: the wheel of a table is the stream at counter (table, round, 0, 1), the same for all its players
+    int64_t wagered = 0, paid = 0, bets = 0, wins = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t c[4] = {id[i] / TABLE_PLAYERS, round, 0, 1};
+        philox4x32(c, k0, k1);
+        uint32_t lucky_number = (uint32_t)(((uint64_t)c[0] * (MAX_NUMBER + 1)) >> 32);
+        int64_t winnings = number[i] == lucky_number ? bet[i] * 35 : 0;
+        money[i] += winnings - bet[i];
+        wagered += bet[i];
+        paid += winnings;
+        bets += bet[i] != 0;
+        wins += winnings != 0;
+    }
+    shard->wagered += wagered;
+    shard->paid += paid;
+    shard->bets += bets;
+    shard->wins += wins;
+
+    // Players that left or went broke are removed, the rest move to the front
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (bet[i] == 0) {
+            shard->saved++;
+            shard->saved_money += money[i];
+        } else if (money[i] <= 0) {
+            shard->broke++;
+        } else {
+            money[kept] = money[i];
+            id[kept++] = id[i];
+        }
+    }
+    shard->count = kept;
+}
+
+// Thread function playing the rounds of one shard until every player left or max_rounds were played
+void *shard_worker(void *arg) {
+    shard_t *shard = (shard_t *)arg;
+    size_t n = shard->players;
+    // Allocated by the thread that uses them, so the pages are local to it
+    shard->money = malloc(n * sizeof(int64_t));
+    shard->bet = malloc(n * sizeof(int64_t));
+    shard->number = malloc(n * sizeof(uint32_t));
+    shard->id = malloc(n * sizeof(uint32_t));
+    if (!shard->money || !shard->bet || !shard->number || !shard->id)
+        ERR("malloc");
+    for (uint32_t i = 0; i < n; i++) {
+        shard->money[i] = shard->start_money;
+        shard->id[i] = shard->first + i;
+    }
+    shard->count = n;
+    for (shard->rounds = 0; shard->rounds < shard->max_rounds && shard->count > 0; shard->rounds++) {
+        INSTR_SCOPE("rc_sim_round");
+        INSTR_COUNT("rc_sim_bets", shard->count);
+        simulate_round(shard, shard->rounds);
+        INSTR_TICK();
+    }
+    free(shard->money);
+    free(shard->bet);
+    free(shard->number);
+    free(shard->id);
+    return NULL;
+}
+
+// Function to simulate many players in process, sharded across threads, and report the house edge
+void simulate(uint32_t players, int start_money, long max_rounds, int thread_count) {
+    shard_t *shards = aligned_alloc(64, thread_count * sizeof(shard_t));
+    pthread_t threads[MAX_THREADS];
+    if (!shards)
+        ERR("aligned_alloc");
+    uint64_t seed = time(NULL) ^ ((uint64_t)getpid() << 32);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int t = 0; t < thread_count; t++) {
+        memset(&shards[t], 0, sizeof(shard_t));
+        shards[t].first = (uint64_t)players * t / thread_count;
+        shards[t].players = (uint64_t)players * (t + 1) / thread_count - shards[t].first;
+        shards[t].start_money = start_money;
+        shards[t].max_rounds = max_rounds;
+        shards[t].key[0] = (uint32_t)seed;
+        shards[t].key[1] = (uint32_t)(seed >> 32);
+        if ((errno = pthread_create(&threads[t], NULL, shard_worker, &shards[t])) != 0)
+            ERR("pthread_create");
+    }
+
+    long rounds = 0, bets = 0, wins = 0, broke = 0, saved = 0;
+    double wagered = 0, paid = 0, saved_money = 0;
+    for (int t = 0; t < thread_count; t++) {
+        if ((errno = pthread_join(threads[t], NULL)) != 0)
+            ERR("pthread_join");
+        if (shards[t].rounds > rounds)
+            rounds = shards[t].rounds;
+        bets += shards[t].bets;
+        wins += shards[t].wins;
+        broke += shards[t].broke;
+        saved += shards[t].saved;
+        wagered += shards[t].wagered;
+        paid += shards[t].paid;
+        saved_money += shards[t].saved_money;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    long still_playing = players - broke - saved;
+
+    printf("%u players with %d each on %d threads, seed %016llx\n", players, start_money, thread_count,
+           (unsigned long long)seed);
+    printf("%ld rounds, %ld bets in %.3f s: %.0f bets/s\n", rounds, bets, seconds, bets / seconds);
+    printf("Wagered %.0f, paid out %.0f\n", wagered, paid);
+    // Stakes grow with the money of lucky players, so the edge on the money wagered is dominated by few large
+    // bets and converges slowly; the edge per bet weighs every bet the same
+    printf("House edge: %.3f%% of the money wagered, %.3f%% per bet (expected %.3f%%)\n",
+           wagered > 0 ? 100.0 * (wagered - paid) / wagered : 0.0, bets > 0 ? 100.0 * (1 - 35.0 * wins / bets) : 0.0,
+           100.0 * (1 - 35.0 / (MAX_NUMBER + 1)));
+    printf("Players: %ld broke, %ld left with %.1f on average, %ld still playing\n", broke, saved,
+           saved > 0 ? saved_money / saved : 0.0, still_playing);
+    free(shards);
+}
+
+int main(int argc, char *argv[]) {
+    int shm = argc > 1 && strcmp(argv[1], "-s") == 0;
+    if ((argc == 5 || argc == 6) && strcmp(argv[1], "-m") == 0) {
+        long players = atol(argv[2]);
+        int start_money = atoi(argv[3]);
+        long max_rounds = atol(argv[4]);
+        int thread_count = argc == 6 ? atoi(argv[5]) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (players < 1 || players > UINT32_MAX || start_money < 100 || max_rounds < 1 || max_rounds > UINT32_MAX ||
+            thread_count < 1 || thread_count > MAX_THREADS) {
+            fprintf(stderr, "Invalid input: players >= 1, money >= 100, rounds >= 1, threads 1..%d\n", MAX_THREADS);
+            return 1;
+        }
+        simulate(players, start_money, max_rounds, thread_count);
+        return 0;
+    }
+    if (argc == 4 && strcmp(argv[1], "-B") == 0) {
+        int max_players = atoi(argv[2]);
+        int rounds = atoi(argv[3]);
+        if (max_players < 1 || rounds < 1) {
+            fprintf(stderr, "Invalid input: max_players >= 1, rounds >= 1\n");
+            return 1;
+        }
+        signal(SIGPIPE, SIG_IGN);
+        srand(time(NULL));
+        benchmark(max_players, rounds);
+        return 0;
+    }
+    if (argc - shm != 3 && argc - shm != 4) {  // Check if the correct number of arguments is passed
+        fprintf(stderr, "Usage: %s [-s] <number_of_players> <start_money> [round_timeout_ms]\n", argv[0]);
+        fprintf(stderr, "       %s -B <max_players> <rounds>\n", argv[0]);
+        fprintf(stderr, "       %s -m <players> <start_money> <max_rounds> [threads]\n", argv[0]);
+        return 1;
+    }
+
+    int num_players = atoi(argv[1 + shm]);   // Number of players (N)
+    int start_money = atoi(argv[2 + shm]);   // Starting money (M)
+    int timeout_ms = argc - shm == 4 ? atoi(argv[3 + shm]) : ROUND_TIMEOUT_MS;
+
+    // Validate the input values
+    if (num_players < 1 || start_money < 100 || timeout_ms < 1) {
+        fprintf(stderr, "Invalid input: N >= 1, M >= 100, timeout >= 1\n");
+        return 1;
+    }
+
+    // A player that leaves between a bet and its result must not kill the dealer
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL));  // Seed the random number generator for the dealer
+
+    if (shm)
+        play_shm(num_players, start_money, timeout_ms);
+    else
+        play_pipes(num_players, start_money, timeout_ms);
+    return 0;
 }
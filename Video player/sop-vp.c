@@ -3,6 +3,8 @@
 #include <stdarg.h>
 #include <stddef.h>
 
+#include "../Instrumentation/sop-instr.h"
+
 typedef unsigned int UINT;
 typedef struct timespec timespec_t;
 
@@ -59,6 +61,7 @@ void circular_buffer_push(circular_buffer* buffer, video_frame* frame) {
             break;
         }
         pthread_mutex_unlock(&buffer->mxbuffer);
+        INSTR_COUNT("vp_push_full_waits", 1);
         msleep(5);
     }    
 }
@@ -76,6 +79,7 @@ video_frame* circular_buffer_pop(circular_buffer* buffer) {
             break;
         }
         pthread_mutex_unlock(buffer->buffer);
+        INSTR_COUNT("vp_pop_empty_waits", 1);
         usleep(5000); 
     }
     return frame;
@@ -107,7 +111,9 @@ void* decoder_thread(void* arg)
     circular_buffer* buffer = (circular_buffer*)arg;
     while (!terminate_flag)
     {
+        INSTR_TIMER_START(decode_start);
         video_frame* frame = decode_frame();
+        INSTR_TIMER_STOP("vp_decode", decode_start);
         circular_buffer_push(buffer, frame);
     }
     return NULL;
@@ -120,7 +126,9 @@ void* transformer_thread(void* arg)
     while (!terminate_flag)
     {
         video_frame* frame = circular_buffer_pop(buffer);
+        INSTR_TIMER_START(transform_start);
         transform_frame(frame);
+        INSTR_TIMER_STOP("vp_transform", transform_start);
         circular_buffer_push(buffer, frame);
     }
     return NULL;
@@ -133,7 +141,10 @@ void* display_thread(void* arg)
     while (!terminate_flag)
     {
         video_frame* frame = circular_buffer_pop(buffer);
+        INSTR_TIMER_START(display_start);
         display_frame(frame);
+        INSTR_TIMER_STOP("vp_display", display_start);
+        INSTR_COUNT("vp_frames_displayed", 1);
     }
     return NULL;
 }
@@ -160,6 +171,7 @@ int main(int argc, char* argv[])
     while (!terminate_flag)
     {
         sleep(1);
+        INSTR_TICK();
     }
 
     // Signal threads to terminate